@@ -1,6 +1,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <locale.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include "bashtypes.h"
 #include "shell.h"
@@ -13,29 +18,755 @@ typedef struct sort_element {
     ARRAY_ELEMENT *v;   // used when sorting array in-place
     char *key;          // used when sorting assoc array
     char *value;        // points to value of array element or assoc entry
-    double num;         // used for numeric sort
+    char *bytes;        // compared byte by byte: value, or its strxfrm key
 } sort_element;
 
 static int reverse_flag;
 static int numeric_flag;
+static int bytes_flag;
+static int sort_jobs;
 
 static int
 compare(const void *p1, const void *p2) {
-    const sort_element e1 = *(sort_element *) p1;
-    const sort_element e2 = *(sort_element *) p2;
+    return strcoll(((const sort_element *) p1)->value, ((const sort_element *) p2)->value);
+}
 
-    if (numeric_flag) {
-        if (reverse_flag)
-            return (e2.num > e1.num) ? 1 : (e2.num < e1.num) ? -1 : 0;
+static int
+compare_reverse(const void *p1, const void *p2) {
+    return strcoll(((const sort_element *) p2)->value, ((const sort_element *) p1)->value);
+}
+
+/*
+ *  Collation keys. strcoll works out the collation weights of both strings
+ *  again on every comparison, which is slow in a locale like en_US.UTF-8.
+ *  For large arrays each value is turned into its strxfrm key once instead,
+ *  and the keys, which sort in byte order the same as strcoll orders the
+ *  values, are sorted like the values in the C locale. The keys are kept in
+ *  blocks that are never moved, so the elements can point into them.
+ */
+#define XFRM_MIN 256            // fewest elements worth making keys for
+#define XFRM_BLOCK (1 << 20)    // bytes in a block of keys
+
+typedef struct xfrm_block {
+    struct xfrm_block *next;
+    size_t size, used;
+    int mapped;         // 1 if made with mmap by a sort thread
+} xfrm_block;
+
+#define BLOCK_DATA(b) ((char *) ((b) + 1))
+
+/*
+ *  returns 1 if strings collate in byte order, as in the C locale
+ */
+static int
+byte_collation(void) {
+    const char *name = setlocale(LC_COLLATE, NULL);
+
+    return name == NULL || STREQ(name, "C") || STREQ(name, "POSIX");
+}
+
+/*
+ *  Gives the elements from up to to their strxfrm keys, adding blocks to
+ *  *blocks as needed. Sort threads must not use bash's malloc, so if mapped
+ *  is set the blocks are made with mmap.
+ *
+ *  returns the index of the first element left without a key, which is to
+ *  unless mmap failed
+ */
+static size_t
+make_xfrm_keys(sort_element *sa, size_t from, size_t to, xfrm_block **blocks, int mapped) {
+    xfrm_block *b;
+    size_t i, len = 0, size;
+
+    for (i = from; i < to; ++i) {
+        b = *blocks;
+        while ( b == NULL
+                || (len = strxfrm(BLOCK_DATA(b) + b->used, sa[i].value, b->size - b->used)) >= b->size - b->used ) {
+            // no room left in the block, start another one that fits the key
+            size = b && len + 1 > XFRM_BLOCK ? len + 1 : XFRM_BLOCK;
+            if (mapped) {
+                b = mmap(NULL, sizeof(xfrm_block) + size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (b == MAP_FAILED)
+                    return i;
+            }
+            else
+                b = xmalloc(sizeof(xfrm_block) + size);
+            b->size = size;
+            b->used = 0;
+            b->mapped = mapped;
+            b->next = *blocks;
+            *blocks = b;
+        }
+        sa[i].bytes = BLOCK_DATA(b) + b->used;
+        b->used += len + 1;
+    }
+    return to;
+}
+
+static void
+free_blocks(xfrm_block *blocks) {
+    xfrm_block *b;
+
+    while ( (b = blocks) ) {
+        blocks = b->next;
+        if (b->mapped)
+            munmap(b, sizeof(xfrm_block) + b->size);
         else
-            return (e1.num > e2.num) ? 1 : (e1.num < e2.num) ? -1 : 0;
+            xfree(b);
     }
-    else {
-        if (reverse_flag)
-            return strcoll(e2.value, e1.value);
+}
+
+/*
+ *  Numeric sort. Each value is mapped to a 64-bit key that sorts as an
+ *  unsigned integer in the same order as the number, and the keys are
+ *  sorted with an LSD radix sort. When every value is a plain integer, like
+ *  timestamps and counters, the key is the integer itself, parsed without
+ *  strtod. The radix sort is stable, so equal numbers keep their order.
+ */
+typedef struct sort_record {
+    uint64_t key;
+    size_t i;           // index of the element in the sort_element array
+} sort_record;
+
+#define SIGN_BIT 0x8000000000000000ULL
+#define RADIX_BITS 11           // most bits sorted on in one pass
+
+/*
+ *  Parses a plain integer, an optional sign and 1 to 18 digits, with
+ *  nothing before or after them.
+ *
+ *  returns 0 if s is not one
+ */
+static int
+parse_integer(const char *s, int64_t *v) {
+    int64_t n = 0;
+    int neg = 0, digits = 0;
+
+    if (*s == '-' || *s == '+')
+        neg = *s++ == '-';
+    for (; *s >= '0' && *s <= '9' && digits < 18; ++s, ++digits)
+        n = n * 10 + (*s - '0');
+    if (digits == 0 || *s)
+        return 0;
+    *v = neg ? -n : n;
+    return 1;
+}
+
+/*
+ *  Parses a plain decimal number, an optional sign and 1 to 15 digits with
+ *  at most one decimal point among them, with nothing before or after them.
+ *  The digits and the power of ten are exact doubles, so dividing them
+ *  gives the same double as strtod, as long as the decimal point of the
+ *  locale is '.'; see decimal_dot.
+ *
+ *  returns 0 if s is not one
+ */
+static int
+parse_decimal(const char *s, double *d) {
+    static const double pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+    };
+    int64_t n = 0;
+    int neg = 0, digits = 0, frac = -1;
+
+    if (*s == '-' || *s == '+')
+        neg = *s++ == '-';
+    for (;; ++s) {
+        if (*s >= '0' && *s <= '9' && digits < 15) {
+            n = n * 10 + (*s - '0');
+            digits++;
+            if (frac >= 0)
+                frac++;
+        }
+        else if (*s == '.' && frac < 0)
+            frac = 0;
         else
-            return strcoll(e1.value, e2.value);
+            break;
     }
+    if (digits == 0 || *s)
+        return 0;
+    *d = (double) n / pow10[frac > 0 ? frac : 0];
+    if (neg)
+        *d = -*d;
+    return 1;
+}
+
+/*
+ *  returns 1 if strtod takes '.' as the decimal point, as parse_decimal
+ *  does, and not the ',' of a locale like de_DE
+ */
+static int
+decimal_dot(void) {
+    return STREQ(localeconv()->decimal_point, ".");
+}
+
+/*
+ *  returns a key for d that sorts like d. -0 gets the key of 0.
+ */
+static uint64_t
+double_key(double d) {
+    uint64_t u;
+
+    if (d == 0)
+        d = 0;
+    memcpy(&u, &d, sizeof(u));
+    return u & SIGN_BIT ? ~u : u | SIGN_BIT;
+}
+
+/*
+ *  Sorts r by key, using tmp, which has room for n records. Only the bits
+ *  that are not the same in every key are looked at, in as few passes of
+ *  up to RADIX_BITS bits as they take.
+ *
+ *  returns r or tmp, whichever the sorted records ended up in
+ */
+static sort_record *
+radix_sort(sort_record *r, sort_record *tmp, size_t n) {
+    size_t count[1 << RADIX_BITS], pos, c, i;
+    sort_record *t;
+    uint64_t diff = 0, mask;
+    int bits, passes, digit, shift, p;
+
+    for (i = 1; i < n; ++i)
+        diff |= r[i].key ^ r[0].key;
+    for (bits = 0; bits < 64 && diff >> bits; ++bits)
+        ;
+    passes = (bits + RADIX_BITS - 1) / RADIX_BITS;
+    digit = passes ? (bits + passes - 1) / passes : 0;
+    mask = ((uint64_t) 1 << digit) - 1;
+
+    for (p = 0, shift = 0; p < passes; ++p, shift += digit) {
+        memset(count, 0, sizeof(count));
+        for (i = 0; i < n; ++i)
+            count[(r[i].key >> shift) & mask]++;
+        for (c = 0, pos = 0; c <= mask; ++c) {
+            i = count[c];
+            count[c] = pos;
+            pos += i;
+        }
+        for (i = 0; i < n; ++i)
+            tmp[count[(r[i].key >> shift) & mask]++] = r[i];
+        t = r;
+        r = tmp;
+        tmp = t;
+    }
+    return r;
+}
+
+/*
+ *  puts the elements of sa in the order of the records in r
+ */
+static void
+reorder(sort_element *sa, sort_record *r, size_t n) {
+    sort_element *copy;
+    size_t i;
+
+    copy = xmalloc(n * sizeof(sort_element));
+    memcpy(copy, sa, n * sizeof(sort_element));
+    for (i = 0; i < n; ++i)
+        sa[i] = copy[r[i].i];
+    xfree(copy);
+}
+
+static void
+sort_numeric(sort_element *sa, size_t n) {
+    sort_record *r, *tmp, *sorted;
+    uint64_t flip = reverse_flag ? ~(uint64_t) 0 : 0;
+    int64_t v;
+    double d;
+    size_t i;
+    int dot = decimal_dot();
+
+    r = xmalloc(n * sizeof(sort_record));
+    for (i = 0; i < n && parse_integer(sa[i].value, &v); ++i) {
+        r[i].key = ((uint64_t) v ^ SIGN_BIT) ^ flip;
+        r[i].i = i;
+    }
+    if (i < n) {
+        // not all integers, so compare them all as doubles, like strtod
+        for (i = 0; i < n; ++i) {
+            if (!dot || !parse_decimal(sa[i].value, &d))
+                d = strtod(sa[i].value, NULL);
+            r[i].key = double_key(d) ^ flip;
+            r[i].i = i;
+        }
+    }
+
+    tmp = xmalloc(n * sizeof(sort_record));
+    sorted = radix_sort(r, tmp, n);
+    reorder(sa, sorted, n);
+    xfree(tmp);
+    xfree(r);
+}
+
+/*
+ *  Byte order sort, for the C locale or -b, and for strxfrm keys. The first
+ *  8 bytes of each string are packed big-endian into the key of its record,
+ *  so comparing keys as integers compares the bytes, and the records are
+ *  sorted by key. Each run of records with the same key is then sorted by
+ *  the next 8 bytes of their strings, until the strings end. Only loading
+ *  the keys reads the strings; small runs are sorted with an insertion sort
+ *  that compares the keys and only reads the rest of the strings on a tie.
+ */
+#define BYTES_RUN_MIN 64        // shortest run sorted with radix_sort
+
+/*
+ *  returns the up to 8 bytes of s as a big-endian integer, padded with 0
+ */
+static uint64_t
+bytes_key(const char *s) {
+    uint64_t key = 0;
+    int j;
+
+    for (j = 0; j < 8 && s[j]; ++j)
+        key |= (uint64_t) (unsigned char) s[j] << (56 - 8 * j);
+    return key;
+}
+
+/*
+ *  Sorts the n records in r, whose keys hold the bytes of their strings
+ *  from depth on, using tmp, which has room for n records. Runs of equal
+ *  keys are sorted by recursion, except for the largest one, which the loop
+ *  goes on with, so the recursion is at most log2(n) deep however long the
+ *  strings share a prefix.
+ */
+static void
+sort_bytes_run(sort_element *sa, sort_record *r, sort_record *tmp, size_t n, size_t depth, uint64_t flip) {
+    sort_record *sorted, t;
+    size_t i, j, start, big, nbig;
+    int c;
+
+    for (;;) {
+        if (n < BYTES_RUN_MIN) {
+            for (i = 1; i < n; ++i) {
+                t = r[i];
+                for (j = i; j > 0; --j) {
+                    if (r[j-1].key < t.key)
+                        break;
+                    if (r[j-1].key == t.key) {
+                        // a key with a 0 last byte holds the end of the value
+                        if (((t.key ^ flip) & 0xff) == 0)
+                            break;
+                        c = strcmp(sa[r[j-1].i].bytes + depth + 8, sa[t.i].bytes + depth + 8);
+                        if ((flip ? -c : c) <= 0)
+                            break;
+                    }
+                    r[j] = r[j-1];
+                }
+                r[j] = t;
+            }
+            return;
+        }
+
+        sorted = radix_sort(r, tmp, n);
+        if (sorted != r)
+            memcpy(r, sorted, n * sizeof(sort_record));
+
+        big = nbig = 0;
+        for (start = 0; start < n; start = i) {
+            for (i = start + 1; i < n && r[i].key == r[start].key; ++i)
+                ;
+            if (i - start < 2 || ((r[start].key ^ flip) & 0xff) == 0)
+                continue;
+            for (j = start; j < i; ++j)
+                r[j].key = bytes_key(sa[r[j].i].bytes + depth + 8) ^ flip;
+            if (i - start > nbig) {
+                if (nbig > 0)
+                    sort_bytes_run(sa, r + big, tmp + big, nbig, depth + 8, flip);
+                big = start;
+                nbig = i - start;
+            }
+            else
+                sort_bytes_run(sa, r + start, tmp + start, i - start, depth + 8, flip);
+        }
+        if (nbig == 0)
+            return;
+        r += big;
+        tmp += big;
+        n = nbig;
+        depth += 8;
+    }
+}
+
+static void
+sort_bytes(sort_element *sa, size_t n) {
+    sort_record *r, *tmp;
+    uint64_t flip = reverse_flag ? ~(uint64_t) 0 : 0;
+    size_t i;
+
+    r = xmalloc(n * sizeof(sort_record));
+    for (i = 0; i < n; ++i) {
+        r[i].key = bytes_key(sa[i].bytes) ^ flip;
+        r[i].i = i;
+    }
+    tmp = xmalloc(n * sizeof(sort_record));
+    sort_bytes_run(sa, r, tmp, n, 0, flip);
+    reorder(sa, r, n);
+    xfree(tmp);
+    xfree(r);
+}
+
+static void
+sort_xfrm(sort_element *sa, size_t n) {
+    xfrm_block *blocks = NULL;
+
+    make_xfrm_keys(sa, 0, n, &blocks, 0);
+    sort_bytes(sa, n);
+    free_blocks(blocks);
+}
+
+/*
+ *  Parallel sort, for arrays of at least 2 * JOB_MIN elements when asort is
+ *  given more than one job. The records are cut into one chunk per thread,
+ *  and every thread makes the keys of its chunk and sorts it as above. The
+ *  chunks are sampled to cut the sorted output into one part per thread,
+ *  and every thread merges the pieces of the chunks that belong in its part
+ *  and puts the elements of its part in order. Records that compare equal
+ *  are ordered by index all along, which keeps the sort stable and lets
+ *  runs of equal values be cut between parts. The threads only read the
+ *  values and write into memory made for them beforehand; they never touch
+ *  shell state or call bash's malloc.
+ */
+#define JOB_MIN (1 << 16)       // fewest elements given to a sort thread
+#define MAX_JOBS 256            // most sort threads -j starts
+
+typedef struct sort_job {
+    pthread_t thread;
+    int started;            // 1 if thread has to be joined
+    sort_element *sa;       // all of the elements
+    sort_record *r, *tmp;   // records of all of the elements, and room for
+                            // as many
+    sort_element *copy;     // copy of sa, to put the elements in order
+    uint64_t flip;          // xored into keys, all 1 bits for -r
+    int xfrm;               // 1 if sorting by strxfrm keys
+    int integers;           // numeric: 1 while trying to parse integers
+    int dot;                // numeric: 1 if parse_decimal can be used
+    xfrm_block *blocks;     // blocks of strxfrm keys made by the thread
+    size_t done;            // first element of the chunk without a key
+    size_t from, to;        // the chunk, then the part of the output
+    size_t *pieces;         // start and end of each run to merge
+    int npieces;
+} sort_job;
+
+static void
+byte_keys(sort_element *sa, sort_record *r, size_t from, size_t to, uint64_t flip) {
+    size_t i;
+
+    for (i = from; i < to; ++i) {
+        r[i].key = bytes_key(sa[i].bytes) ^ flip;
+        r[i].i = i;
+    }
+}
+
+/*
+ *  Sorts the n records in r by key, using tmp, which has room for n
+ *  records. String records are left with the first 8 bytes in their keys.
+ */
+static void
+sort_records(sort_element *sa, sort_record *r, sort_record *tmp, size_t n, uint64_t flip) {
+    sort_record *sorted;
+    size_t i;
+
+    if (numeric_flag) {
+        sorted = radix_sort(r, tmp, n);
+        if (sorted != r)
+            memcpy(r, sorted, n * sizeof(sort_record));
+        return;
+    }
+    sort_bytes_run(sa, r, tmp, n, 0, flip);
+    for (i = 0; i < n; ++i)
+        r[i].key = bytes_key(sa[r[i].i].bytes) ^ flip;
+}
+
+/*
+ *  returns <0, 0 or >0 as a sorts before, with or after b
+ */
+static int
+compare_records(const sort_element *sa, const sort_record *a, const sort_record *b, uint64_t flip) {
+    int c;
+
+    if (a->key != b->key)
+        return a->key < b->key ? -1 : 1;
+    if (numeric_flag || ((a->key ^ flip) & 0xff) == 0)
+        return 0;
+    c = strcmp(sa[a->i].bytes + 8, sa[b->i].bytes + 8);
+    return flip ? -c : c;
+}
+
+/*
+ *  returns 1 if a sorts before b, or is equal and comes before it
+ */
+static int
+record_before(const sort_element *sa, const sort_record *a, const sort_record *b, uint64_t flip) {
+    int c = compare_records(sa, a, b, flip);
+
+    return c < 0 || (c == 0 && a->i < b->i);
+}
+
+static void *
+job_keys(void *arg) {
+    sort_job *j = arg;
+    sort_element *sa = j->sa;
+    sort_record *r = j->r;
+    int64_t v;
+    double d;
+    size_t i;
+
+    if (numeric_flag) {
+        for (i = j->from; i < j->to; ++i) {
+            if (j->integers) {
+                if (!parse_integer(sa[i].value, &v)) {
+                    j->integers = 0;
+                    break;
+                }
+                r[i].key = ((uint64_t) v ^ SIGN_BIT) ^ j->flip;
+            }
+            else {
+                if (!j->dot || !parse_decimal(sa[i].value, &d))
+                    d = strtod(sa[i].value, NULL);
+                r[i].key = double_key(d) ^ j->flip;
+            }
+            r[i].i = i;
+        }
+        return NULL;
+    }
+    if (j->xfrm) {
+        j->done = make_xfrm_keys(sa, j->from, j->to, &j->blocks, 1);
+        if (j->done < j->to)
+            return NULL;
+    }
+    else {
+        for (i = j->from; i < j->to; ++i)
+            sa[i].bytes = sa[i].value;
+    }
+    byte_keys(sa, r, j->from, j->to, j->flip);
+    return NULL;
+}
+
+static void *
+job_sort(void *arg) {
+    sort_job *j = arg;
+
+    sort_records(j->sa, j->r + j->from, j->tmp + j->from, j->to - j->from, j->flip);
+    return NULL;
+}
+
+/*
+ *  Merges the runs of src in pairs into dst, from the start of the part on.
+ */
+static void
+merge_pass(sort_job *j, sort_record *src, sort_record *dst) {
+    const sort_record *a, *b;
+    size_t na, nb, out = j->from;
+    int p, n = 0;
+
+    for (p = 0; p < j->npieces; p += 2) {
+        a = src + j->pieces[2*p];
+        na = j->pieces[2*p+1] - j->pieces[2*p];
+        b = src + (p + 1 < j->npieces ? j->pieces[2*p+2] : 0);
+        nb = p + 1 < j->npieces ? j->pieces[2*p+3] - j->pieces[2*p+2] : 0;
+        j->pieces[2*n] = out;
+        j->pieces[2*n+1] = out + na + nb;
+        n++;
+        while (na && nb) {
+            if (compare_records(j->sa, b, a, j->flip) < 0) {
+                dst[out++] = *b++;
+                nb--;
+            }
+            else {
+                dst[out++] = *a++;
+                na--;
+            }
+        }
+        memcpy(dst + out, a, na * sizeof(sort_record));
+        out += na;
+        memcpy(dst + out, b, nb * sizeof(sort_record));
+        out += nb;
+    }
+    j->npieces = n;
+}
+
+/*
+ *  Merges the pieces of the part from the chunks in r into tmp. The
+ *  pieces come from every chunk, so r is only written once every thread
+ *  is done with this.
+ */
+static void *
+job_merge_chunks(void *arg) {
+    sort_job *j = arg;
+
+    merge_pass(j, j->r, j->tmp);
+    return NULL;
+}
+
+static void *
+job_merge_part(void *arg) {
+    sort_job *j = arg;
+    sort_record *src = j->tmp, *dst = j->r, *t;
+
+    while (j->npieces > 1) {
+        merge_pass(j, src, dst);
+        t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != j->r)
+        memcpy(j->r + j->from, src + j->from, (j->to - j->from) * sizeof(sort_record));
+    return NULL;
+}
+
+static void *
+job_reorder(void *arg) {
+    sort_job *j = arg;
+    size_t i;
+
+    for (i = j->from; i < j->to; ++i)
+        j->sa[i] = j->copy[j->r[i].i];
+    return NULL;
+}
+
+/*
+ *  Runs fn for every job, each in its own thread, or in this one if the
+ *  thread could not be started, and waits for them all. The threads start
+ *  with every signal blocked, so bash's handlers only run on this one.
+ */
+static void
+run_jobs(sort_job *j, int n, void *(*fn)(void *)) {
+    sigset_t all, old;
+    int i;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (i = 0; i < n; ++i)
+        j[i].started = pthread_create(&j[i].thread, NULL, fn, &j[i]) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    for (i = 0; i < n; ++i)
+        if (!j[i].started)
+            fn(&j[i]);
+    for (i = 0; i < n; ++i)
+        if (j[i].started)
+            pthread_join(j[i].thread, NULL);
+}
+
+static void
+sort_parallel(sort_element *sa, size_t n, int jobs) {
+    sort_job *j;
+    sort_record *r, *tmp, *samples;
+    sort_element *copy;
+    size_t *cut, *pieces, lo, hi, mid, from, to, start;
+    uint64_t flip = reverse_flag ? ~(uint64_t) 0 : 0;
+    int c, t, integers = 1, k = jobs, dot = decimal_dot();
+
+    r = xmalloc(n * sizeof(sort_record));
+    tmp = xmalloc(n * sizeof(sort_record));
+    j = xmalloc(k * sizeof(sort_job));
+    memset(j, 0, k * sizeof(sort_job));
+    for (c = 0; c < k; ++c) {
+        j[c].sa = sa;
+        j[c].r = r;
+        j[c].tmp = tmp;
+        j[c].flip = flip;
+        j[c].xfrm = !numeric_flag && !bytes_flag && !byte_collation();
+        j[c].integers = 1;
+        j[c].dot = dot;
+        j[c].from = n / k * c;
+        j[c].to = c == k - 1 ? n : n / k * (c + 1);
+    }
+
+    run_jobs(j, k, job_keys);
+    for (c = 0; c < k; ++c) {
+        integers &= j[c].integers;
+        if (!numeric_flag && j[c].xfrm && j[c].done < j[c].to) {
+            // a thread could not map a block, make the rest of its keys here
+            make_xfrm_keys(sa, j[c].done, j[c].to, &j[c].blocks, 0);
+            byte_keys(sa, r, j[c].from, j[c].to, flip);
+        }
+    }
+    if (numeric_flag && !integers) {
+        // not all integers, so compare them all as doubles, like strtod
+        for (c = 0; c < k; ++c)
+            j[c].integers = 0;
+        run_jobs(j, k, job_keys);
+    }
+    run_jobs(j, k, job_sort);
+
+    // k samples evenly spaced in each sorted chunk, sorted, give the k - 1
+    // records where parts start, and where they fall in every chunk
+    samples = xmalloc(2 * k * k * sizeof(sort_record));
+    for (c = 0; c < k; ++c)
+        for (t = 0; t < k; ++t)
+            samples[c * k + t] = r[j[c].from + (j[c].to - j[c].from) / k * t];
+    sort_records(sa, samples, samples + k * k, k * k, flip);
+    cut = xmalloc(k * (k + 1) * sizeof(size_t));
+    for (c = 0; c < k; ++c) {
+        cut[c * (k + 1)] = j[c].from;
+        cut[c * (k + 1) + k] = j[c].to;
+        for (t = 1; t < k; ++t) {
+            lo = cut[c * (k + 1) + t - 1];
+            hi = j[c].to;
+            while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if (record_before(sa, &r[mid], &samples[t * k], flip))
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            cut[c * (k + 1) + t] = lo;
+        }
+    }
+    xfree(samples);
+
+    pieces = xmalloc(2 * k * k * sizeof(size_t));
+    for (t = 0, start = 0; t < k; ++t) {
+        j[t].pieces = pieces + 2 * k * t;
+        j[t].npieces = k;
+        for (c = 0, to = start; c < k; ++c) {
+            from = cut[c * (k + 1) + t];
+            j[t].pieces[2*c] = from;
+            j[t].pieces[2*c+1] = cut[c * (k + 1) + t + 1];
+            to += cut[c * (k + 1) + t + 1] - from;
+        }
+        j[t].from = start;
+        j[t].to = start = to;
+    }
+    xfree(cut);
+    run_jobs(j, k, job_merge_chunks);
+    run_jobs(j, k, job_merge_part);
+    xfree(pieces);
+
+    copy = xmalloc(n * sizeof(sort_element));
+    memcpy(copy, sa, n * sizeof(sort_element));
+    for (c = 0; c < k; ++c)
+        j[c].copy = copy;
+    run_jobs(j, k, job_reorder);
+    xfree(copy);
+
+    for (c = 0; c < k; ++c)
+        free_blocks(j[c].blocks);
+    xfree(j);
+    xfree(tmp);
+    xfree(r);
+}
+
+static void
+sort_elements(sort_element *sa, size_t n) {
+    size_t i;
+
+    if (n < 2)
+        return;
+    if (sort_jobs > 1 && n / JOB_MIN > 1)
+        sort_parallel(sa, n, (size_t) sort_jobs < n / JOB_MIN ? sort_jobs : (int) (n / JOB_MIN));
+    else if (numeric_flag)
+        sort_numeric(sa, n);
+    else if (bytes_flag || byte_collation()) {
+        for (i = 0; i < n; ++i)
+            sa[i].bytes = sa[i].value;
+        sort_bytes(sa, n);
+    }
+    else if (n >= XFRM_MIN)
+        sort_xfrm(sa, n);
+    else
+        qsort(sa, n, sizeof(sort_element), reverse_flag ? compare_reverse : compare);
 }
 
 static int
@@ -61,10 +792,7 @@ sort_index(SHELL_VAR *dest, SHELL_VAR *source) {
             while ( bucket ) {
                 sa[i].v = NULL;
                 sa[i].key = bucket->key;
-                if ( numeric_flag )
-                    sa[i].num = strtod(bucket->data, NULL);
-                else
-                    sa[i].value = bucket->data;
+                sa[i].value = bucket->data;
                 i++;
                 bucket = bucket->next;
             }
@@ -78,10 +806,7 @@ sort_index(SHELL_VAR *dest, SHELL_VAR *source) {
 
         for (ae = element_forw(array->head); ae != array->head; ae = element_forw(ae)) {
             sa[i].v = ae;
-            if (numeric_flag)
-                sa[i].num = strtod(element_value(ae), NULL);
-            else
-                sa[i].value = element_value(ae);
+            sa[i].value = element_value(ae);
             i++;
         }
     }
@@ -92,7 +817,7 @@ sort_index(SHELL_VAR *dest, SHELL_VAR *source) {
         return EXECUTION_FAILURE;
     }
 
-    qsort(sa, n, sizeof(sort_element), compare);
+    sort_elements(sa, n);
 
     array_flush(dest_array);
 
@@ -104,6 +829,7 @@ sort_index(SHELL_VAR *dest, SHELL_VAR *source) {
 
         array_insert(dest_array, i, key);
     }
+    xfree(sa);
 
     return EXECUTION_SUCCESS;
 }
@@ -126,10 +852,7 @@ sort_inplace(SHELL_VAR *var) {
     i = 0;
     for (ae = element_forw(a->head); ae != a->head; ae = element_forw(ae)) {
         sa[i].v = ae;
-        if (numeric_flag)
-            sa[i].num = strtod(element_value(ae), NULL);
-        else
-            sa[i].value = element_value(ae);
+        sa[i].value = element_value(ae);
         i++;
     }
 
@@ -139,7 +862,7 @@ sort_inplace(SHELL_VAR *var) {
         return EXECUTION_FAILURE;
     }
 
-    qsort(sa, n, sizeof(sort_element), compare);
+    sort_elements(sa, n);
 
     // for in-place sort, simply "rewire" the array elements
     sa[0].v->prev = sa[n-1].v->next = a->head;
@@ -163,14 +886,27 @@ asort_builtin(WORD_LIST *list) {
     char *word;
     int opt, ret;
     int index_flag = 0;
+    intmax_t jobs = 1;
 
     numeric_flag = 0;
     reverse_flag = 0;
+    bytes_flag = 0;
 
     reset_internal_getopt();
-    while ((opt = internal_getopt(list, "inr")) != -1) {
+    while ((opt = internal_getopt(list, "bij:nr")) != -1) {
         switch (opt) {
+            case 'b': bytes_flag = 1; break;
             case 'i': index_flag = 1; break;
+            case 'j':
+                if (legal_number(list_optarg, &jobs) == 0 || jobs < 0) {
+                    builtin_error("%s: invalid number of jobs", list_optarg);
+                    return EXECUTION_FAILURE;
+                }
+                if (jobs == 0)
+                    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+                if (jobs > MAX_JOBS)
+                    jobs = MAX_JOBS;
+                break;
             case 'n': numeric_flag = 1; break;
             case 'r': reverse_flag = 1; break;
             CASE_HELPOPT;
@@ -180,6 +916,7 @@ asort_builtin(WORD_LIST *list) {
         }
     }
     list = loptend;
+    sort_jobs = jobs;
 
     if (list == 0) {
         builtin_usage();
@@ -228,8 +965,11 @@ char *asort_doc[] = {
     "Sort arrays in-place.",
     "",
     "Options:",
-    "  -n  compare according to string numerical value",
-    "  -r  reverse the result of comparisons",
+    "  -b       compare strings byte by byte, as in the C locale",
+    "  -j jobs  sort large arrays with up to JOBS threads, or one per CPU",
+    "           if JOBS is 0",
+    "  -n       compare according to string numerical value",
+    "  -r       reverse the result of comparisons",
     "",
     "If -i is supplied, SOURCE is not sorted in-place, but the indices (or keys",
     "if associative) of SOURCE, after sorting it by its values, are placed as",
@@ -246,7 +986,7 @@ struct builtin asort_struct = {
     asort_builtin,
     BUILTIN_ENABLED,
     asort_doc,
-    "asort [-nr] array ...  or  asort [-nr] -i dest source",
+    "asort [-bnr] [-j jobs] array ...  or  asort [-bnr] [-j jobs] -i dest source",
     0
 };
 
@@ -1,7 +1,37 @@
+// for splice(2), before any system header
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE 1
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <pthread.h>
+
+#if defined(CSV_GZIP)
+#include <zlib.h>
+#endif
+#if defined(CSV_ZSTD)
+#include <zstd.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX2_SCANNER 1
+#endif
 
 #include "bashtypes.h"
 #include "shell.h"
@@ -10,17 +40,167 @@
 #include "xmalloc.h"
 #include "bashgetopt.h"
 
+#define CSV_BUFSIZE 65536
+#define CSV_MMAP_MIN (4 * CSV_BUFSIZE)  // smaller files are just read
+#define CSV_MAX_FIELD (1 << 24)         // highest field number -f accepts
+#define CSV_CHUNK_MIN (1 << 20)         // smallest part of a file given to a thread
+#define CSV_MAX_JOBS 256                // most parser threads -j starts
+#define CSV_INDEX_STEP 1024             // rows between the offsets in an index
+#define CSV_ZBUFSIZE (4 * CSV_BUFSIZE)  // block size for compressed input
+#define CSV_MAX_BAD 100                 // most malformed rows -S lists
+#define CSV_MAX_SHARDS 1024             // most fds -O writes to
+#define CSV_CACHE_ORDER (0x0102030405060700ULL + sizeof(size_t))  // -X byte order
+
+/*
+ *  Field values of the row being read are stored one after another, each
+ *  NUL-terminated, in an arena that is only ever grown. It belongs to the
+ *  fd's buffer, so after the first few rows no more allocations are needed.
+ */
+typedef struct CSV_arena {
+    char *data;
+    size_t size;            // bytes allocated
+    size_t used;            // bytes in use by the current row
+    unsigned long allocs;   // number of times data was (re)allocated
+    int mapped;             // 1 if data is an anonymous mapping, see map_grow
+} CSV_arena;
+
+/*
+ *  A field value is a slice of the arena, so it stays valid while the arena
+ *  grows. Use field_value() to get at the string.
+ */
+typedef struct CSV_field {
+    size_t off;     // offset of the value in the arena
+    size_t len;     // length of the value, not counting the NUL
+} CSV_field;
+
+/*
+ *  A field of a row read ahead to test the -w predicates, and the separator
+ *  that ended it.
+ */
+typedef struct CSV_slot {
+    CSV_field field;
+    int sep;
+} CSV_slot;
+
+/*
+ *  Compression of the input, for -z. CODEC_AUTO looks at the first bytes
+ *  read from the fd to tell.
+ */
+enum { CODEC_AUTO, CODEC_NONE, CODEC_GZIP, CODEC_ZSTD };
+
+/*
+ *  Decompressor of a compressed fd. Compressed bytes are read into in, and
+ *  decompressed into the buffer's data, a block at a time.
+ */
+typedef struct CSV_codec {
+    int type;       // CODEC_GZIP or CODEC_ZSTD
+    char *in;       // CSV_ZBUFSIZE bytes read from the fd
+    size_t in_pos;  // next byte to decompress
+    size_t in_len;  // number of valid bytes in in
+    int eof;        // 1 once the fd is at eof
+    int done;       // 1 at the end of the input, or after an error
+    int between;    // 1 right after the end of a gzip member
+    off_t offset;   // fd offset after the last read, or -1 if the fd is not
+                    // seekable
+#if defined(CSV_GZIP)
+    z_stream z;
+#endif
+#if defined(CSV_ZSTD)
+    ZSTD_DStream *zd;
+#endif
+} CSV_codec;
+
+/*
+ *  Read-ahead buffer for one fd. These live across calls, so bytes read ahead
+ *  from a pipe are not lost between rows. The device and inode numbers are
+ *  used to notice when the fd has been closed or replaced.
+ */
+typedef struct CSV_buffer {
+    int fd;         // fd the buffered bytes belong to
+    dev_t dev;      // st_dev of fd when the buffer was filled
+    ino_t ino;      // st_ino of fd when the buffer was filled
+    int seekable;   // 1 if unparsed bytes can be given back with lseek
+    int mapped;     // 1 if data is a mapping of the whole file
+    time_t mtime;   // st_mtime of a mapped file
+    char *data;     // CSV_BUFSIZE bytes read ahead from fd, or the mapping,
+                    // or CSV_ZBUFSIZE bytes decompressed
+    size_t pos;     // next byte to parse (file offset if mapped)
+    size_t len;     // number of valid bytes in data
+    CSV_arena arena;
+    CSV_slot *slots;    // fields of the row being tested, only ever grown
+    int slots_size;     // number of slots allocated
+    struct CSV_index *index;    // last index used with -x on this fd
+    CSV_codec *codec;           // decompressor, NULL if fd is not compressed
+    unsigned long reads;        // number of read(2) calls made on fd
+    struct CSV_buffer *next;
+} CSV_buffer;
+
+/*
+ *  Output buffer for csv -p. Rows are built here and written with write(2)
+ *  when it fills up and at the end of each call.
+ */
+typedef struct CSV_output {
+    int fd;         // fd to write to
+    char *data;     // CSV_BUFSIZE bytes
+    size_t len;     // bytes waiting to be written
+    int error;      // errno of the first failed write, or 0
+} CSV_output;
+
 typedef struct CSV_context {
     int fd;     // fd to read from (default: 0)
     int col;    // current column number (starting from 0)
     int rs;     // record separator (default: -1, meaning "\r\n" or '\n')
     int fs;     // field separator (default: ',')
     int q;      // quote character (default: '"')
-    ARRAY *cut; // list of fields to include
-    int to_inf; // 1 if -f ended with N-, 0 otherwise
+    unsigned char *cut;         // bitmap of fields to include, NULL for all
+    int cut_len;                // number of fields covered by cut
+    int cut_from;               // fields from here on are all included
+    int last;                   // last field included, INT_MAX if no limit
     int print_mode;
+    CSV_buffer *in;             // read-ahead buffer for fd
+    CSV_arena *arena;           // field values of the current row
+    unsigned char stop[4];      // bytes that end a run outside quotes
+    unsigned char qstop[4];     // bytes that end a run inside quotes
+    int drop_nul;               // 1 if NUL bytes are silently dropped
+    CSV_output *out;            // output buffer for -p
+    unsigned char pstop[4];     // bytes that make a printed field quoted
+    int quote_fields;           // 0 if no field can need quoting
+    struct CSV_pred *preds;     // -w predicates, see match_row
+    int npreds;
+    unsigned char *pcut;        // bitmap of fields the predicates look at
+    int plast;                  // highest field the predicates look at
+    int replay;                 // 1 if next_field returns the row in slots
+    int nslots;                 // number of fields in slots
+    int row_end;                // separator that ended the row in slots
+    int codec;                  // -z compression, CODEC_AUTO by default
+    int map;                    // -m: parse large regular files from a mapping
+    int *widths;                // -W field widths, NULL if not fixed width
+    int nwidths;
 } CSV_context;
 
+/*
+ *  A -w predicate: a test of one field. Predicates are ANDed together,
+ *  except that one with or set starts a new alternative.
+ */
+enum { PRED_EQ, PRED_NE, PRED_PREFIX, PRED_NUM_EQ, PRED_LT, PRED_LE, PRED_GT, PRED_GE };
+
+typedef struct CSV_pred {
+    int col;
+    int op;         // PRED_*
+    int or;         // 1 if this predicate starts an alternative
+    char *str;      // string compared with, for PRED_EQ, PRED_NE and PRED_PREFIX
+    size_t len;
+    double num;     // number compared with otherwise
+} CSV_pred;
+
+static CSV_buffer *buffers = NULL;
+static CSV_output output = { 1, NULL, 0, 0 };
+
+#define field_value(ctx, f) ((ctx)->arena->data + (f).off)
+
+// true if c, returned as separator, ended the row
+#define is_rs(c, ctx) ((c) == (ctx)->rs || (ctx)->rs == -1 && (c) == '\n')
+
 /* Copied from builtins/read.def */
 static SHELL_VAR *
 bind_read_variable (name, value)
@@ -43,296 +223,4135 @@ bind_read_variable (name, value)
 int
 skip_field(arrayind_t n, CSV_context *ctx)
 {
-    if ( ctx->cut == 0 || n > array_max_index(ctx->cut) && ctx->to_inf )
+    if ( ctx->cut == 0 || n >= ctx->cut_from )
         return 0;
-    return array_reference(ctx->cut, n) ? 0 : 1;
+    return n >= ctx->cut_len || !(ctx->cut[n >> 3] & 1 << (n & 7));
+}
+
+/*
+ *  Parses a number of at most CSV_MAX_FIELD at *s, and moves *s past it.
+ *  returns -1 if there are no digits or the number is too large
+ */
+static int
+parse_field_number(char **s)
+{
+    int n = 0;
+
+    if ( !isdigit((unsigned char) **s) )
+        return -1;
+    while ( isdigit((unsigned char) **s) ) {
+        n = n * 10 + *(*s)++ - '0';
+        if ( n > CSV_MAX_FIELD )
+            return -1;
+    }
+    return n;
 }
 
+/*
+ *  Compiles the -f list into a bitmap with one bit per field up to the
+ *  highest field in a closed range, and the start of the lowest open-ended
+ *  range. The bitmap is kept until the next call, instead of being freed on
+ *  every return path of csv_builtin.
+ */
+static unsigned char *cut_storage = NULL;
+
 int
 parse_list(char *s, CSV_context *ctx)
 {
-    ARRAY *a;
+    unsigned char *cut = NULL;
+    int cut_len = 0, cut_from = INT_MAX, last = -1;
     char *range;
-    arrayind_t i, from, to;
+    int i, from, to, len;
 
-    a = array_create();
-    
     for (range = strtok(s, ","); range; range = strtok(NULL, ",")) {
         from = 0;
-        to = -1;
-        if (*range == '\0')
-            return 0;
-        else if (*range == '-') { // -M
-            to = 0;
-            while ( *++range ) {
-                if ( ! isdigit(*range) )
-                    return 0;
-                to = to * 10 + *range - '0';
-            }
-        }
-        else if ( ! isdigit(*range) )
-            return 0;
-        else {                  // N, N-M or N-
-            from = *range - '0';
-            while ( *++range && *range != '-') {
-                if ( ! isdigit(*range) )
-                    return 0;
-                from = from * 10 + *range - '0';
-            }
-            if (*range == '\0') {
-                to = from;
-            }
-            else if ( *(range+1) == 0 )
-                to = -1;
-            else {
-                to = 0;
-                while ( *++range ) {
-                    if ( ! isdigit(*range) )
-                        return 0;
-                    to = to * 10 + *range - '0';
-                }
-            }
-        }
+        if (*range != '-' && (from = parse_field_number(&range)) < 0)
+            goto illegal;
+        if (*range == '\0')            // N
+            to = from;
+        else if (*range++ != '-')
+            goto illegal;
+        else if (*range == '\0')       // N-
+            to = -1;
+        else if ((to = parse_field_number(&range)) < 0 || *range != '\0' || to < from)
+            goto illegal;               // -M or N-M
+
         if ( to == -1 ) {
-            array_insert(a, from, "");
-            ctx->to_inf = 1;
+            if ( from < cut_from )
+                cut_from = from;
+            continue;
         }
-        else if (to < from)
+        if ( to >= cut_len ) {
+            len = (to + 8) & ~7;
+            cut = xrealloc(cut, len / 8);
+            memset(cut + cut_len / 8, 0, (len - cut_len) / 8);
+            cut_len = len;
+        }
+        for (i = from; i <= to; ++i)
+            cut[i >> 3] |= 1 << (i & 7);
+        if ( to > last )
+            last = to;
+    }
+    if ( cut == NULL && cut_from == INT_MAX )
+        goto illegal;
+
+    if ( cut == NULL )
+        cut = xmalloc(1);
+    xfree(cut_storage);
+    ctx->cut = cut_storage = cut;
+    ctx->cut_len = cut_len;
+    ctx->cut_from = cut_from;
+    ctx->last = cut_from == INT_MAX ? last : INT_MAX;
+    return 1;
+
+illegal:
+    xfree(cut);
+    return 0;
+}
+
+/*
+ *  Sets the projection to just the n fields in cols, so that the parser
+ *  skips over everything else.
+ */
+static void
+select_fields(const int *cols, int n, CSV_context *ctx)
+{
+    int i, last = 0;
+
+    for (i = 0; i < n; ++i)
+        if ( cols[i] > last )
+            last = cols[i];
+    xfree(cut_storage);
+    ctx->cut = cut_storage = xmalloc(last / 8 + 1);
+    memset(ctx->cut, 0, last / 8 + 1);
+    for (i = 0; i < n; ++i)
+        ctx->cut[cols[i] >> 3] |= 1 << (cols[i] & 7);
+    ctx->cut_len = (last + 8) & ~7;
+    ctx->cut_from = INT_MAX;
+    ctx->last = last;
+}
+
+/*
+ *  Compiles the -W list of field widths, a comma separated list of numbers,
+ *  kept until the next call like the -f bitmap.
+ */
+static int *widths_storage = NULL;
+
+int
+parse_widths(char *s, CSV_context *ctx)
+{
+    int *widths = NULL;
+    int n = 0, width;
+    char *w;
+
+    for (w = strtok(s, ","); w; w = strtok(NULL, ",")) {
+        if ( (width = parse_field_number(&w)) <= 0 || *w != '\0' ) {
+            xfree(widths);
             return 0;
-        else {
-            for (i = from; i <= to; ++i) {
-                array_insert(a, i, "");
-            }
         }
+        widths = xrealloc(widths, (n + 1) * sizeof(int));
+        widths[n++] = width;
     }
-    ctx->cut = a;
+    if ( n == 0 )
+        return 0;
+    xfree(widths_storage);
+    ctx->widths = widths_storage = widths;
+    ctx->nwidths = n;
     return 1;
 }
 
 /*
- *  field is malloced, and filled with the next field separated either by the
- *  field separator or row separator. Caller should free it.
+ *  Block scanner. Each of the scan functions returns the offset of the first
+ *  byte in s[0..n) that is one of the four bytes in set, or n if there is
+ *  none. Sets with fewer than four distinct bytes just repeat one of them.
+ */
+
+static size_t
+scan_bytes_generic(const char *s, size_t n, const unsigned char *set)
+{
+    const unsigned char *p = (const unsigned char *) s;
+    size_t i;
+
+    for (i = 0; i < n; ++i)
+        if (p[i] == set[0] || p[i] == set[1] || p[i] == set[2] || p[i] == set[3])
+            break;
+    return i;
+}
+
+#if defined(__SSE2__)
+static size_t
+scan_bytes_sse2(const char *s, size_t n, const unsigned char *set)
+{
+    const __m128i a = _mm_set1_epi8(set[0]), b = _mm_set1_epi8(set[1]);
+    const __m128i c = _mm_set1_epi8(set[2]), d = _mm_set1_epi8(set[3]);
+    __m128i v, m;
+    size_t i;
+    int mask;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (s + i));
+        m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, a), _mm_cmpeq_epi8(v, b)),
+                         _mm_or_si128(_mm_cmpeq_epi8(v, c), _mm_cmpeq_epi8(v, d)));
+        if ( (mask = _mm_movemask_epi8(m)) )
+            return i + __builtin_ctz(mask);
+    }
+    return i + scan_bytes_generic(s + i, n - i, set);
+}
+#endif
+
+#if defined(HAVE_AVX2_SCANNER)
+__attribute__((target("avx2")))
+static size_t
+scan_bytes_avx2(const char *s, size_t n, const unsigned char *set)
+{
+    const __m256i a = _mm256_set1_epi8(set[0]), b = _mm256_set1_epi8(set[1]);
+    const __m256i c = _mm256_set1_epi8(set[2]), d = _mm256_set1_epi8(set[3]);
+    __m256i v, m;
+    size_t i;
+    unsigned int mask;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (s + i));
+        m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, a), _mm256_cmpeq_epi8(v, b)),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(v, c), _mm256_cmpeq_epi8(v, d)));
+        if ( (mask = _mm256_movemask_epi8(m)) )
+            return i + __builtin_ctz(mask);
+    }
+    return i + scan_bytes_generic(s + i, n - i, set);
+}
+#endif
+
+static size_t (*scan_bytes)(const char *, size_t, const unsigned char *);
+
+static void
+init_scanner(void)
+{
+#if defined(__SSE2__)
+    scan_bytes = scan_bytes_sse2;
+#else
+    scan_bytes = scan_bytes_generic;
+#endif
+#if defined(HAVE_AVX2_SCANNER)
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports("avx2") )
+        scan_bytes = scan_bytes_avx2;
+#endif
+}
+
+/*
+ *  Row index, for -x. It holds the offset of every CSV_INDEX_STEP-th row of a
+ *  file, so that any row can be reached by seeking to the offset before it
+ *  and skipping at most CSV_INDEX_STEP - 1 rows. Row boundaries depend on
+ *  the row separator and quote character, so these are part of the index,
+ *  along with the size and mtime of the file it was made for.
+ */
+typedef struct CSV_index {
+    char *path;         // sidecar file the index was loaded from or saved to
+    off_t size;
+    time_t mtime;
+    int rs, q;
+    uintmax_t rows;     // number of rows in the file
+    size_t n;           // number of offsets
+    off_t *offsets;     // offsets[i] is where row i * CSV_INDEX_STEP starts
+} CSV_index;
+
+static void
+free_index(CSV_index *idx)
+{
+    if ( idx == NULL )
+        return;
+    xfree(idx->path);
+    xfree(idx->offsets);
+    xfree(idx);
+}
+
+/*
+ *  Decompression. A compressed fd is never mapped and cannot give unparsed
+ *  bytes back, so it is read like a pipe: what is decompressed ahead stays
+ *  in the buffer for the next call. On a seekable fd, that is only right as
+ *  long as the offset is where the last read left it.
+ */
+static void
+free_codec(CSV_codec *c)
+{
+    if ( c == NULL )
+        return;
+#if defined(CSV_GZIP)
+    if ( c->type == CODEC_GZIP )
+        inflateEnd(&c->z);
+#endif
+#if defined(CSV_ZSTD)
+    if ( c->type == CODEC_ZSTD )
+        ZSTD_freeDStream(c->zd);
+#endif
+    xfree(c->in);
+    xfree(c);
+}
+
+/*
+ *  returns the codec whose magic bytes start s[0..n), or CODEC_NONE
+ */
+static int
+detect_codec(const unsigned char *s, size_t n)
+{
+    if ( n >= 2 && s[0] == 0x1f && s[1] == 0x8b )
+        return CODEC_GZIP;
+    if ( n >= 4 && s[0] == 0x28 && s[1] == 0xb5 && s[2] == 0x2f && s[3] == 0xfd )
+        return CODEC_ZSTD;
+    return CODEC_NONE;
+}
+
+static const char *codec_names[] = { "auto", "none", "gzip", "zstd" };
+
+/*
+ *  Starts decompressing b with a codec of the given type. The n bytes at
+ *  s were already read from the fd, and are the first ones decompressed.
  *
- *  returns the separator (fs or rs or '\n') or -1 if eof or error
- * TODO: print error messages
+ *  returns 0 if csv was built without support for the codec
  */
+static int
+start_codec(CSV_buffer *b, int type, const char *s, size_t n)
+{
+    CSV_codec *c = xmalloc(sizeof(CSV_codec));
 
-int
-read_csv_field(char **field, CSV_context *ctx)
+    c->type = type;
+    c->in_pos = 0;
+    c->in_len = n;
+    c->eof = c->done = c->between = 0;
+    c->offset = -1;
+    switch (type) {
+#if defined(CSV_GZIP)
+        case CODEC_GZIP:
+            memset(&c->z, 0, sizeof(c->z));
+            if ( inflateInit2(&c->z, 15 + 32) != Z_OK )
+                goto fail;
+            break;
+#endif
+#if defined(CSV_ZSTD)
+        case CODEC_ZSTD:
+            if ( (c->zd = ZSTD_createDStream()) == NULL )
+                goto fail;
+            ZSTD_initDStream(c->zd);
+            break;
+#endif
+        default:
+            goto fail;
+    }
+    c->in = xmalloc(CSV_ZBUFSIZE);
+    if ( n )
+        memcpy(c->in, s, n);
+    xfree(b->data);
+    b->data = xmalloc(CSV_ZBUFSIZE);
+    b->pos = b->len = 0;
+    b->seekable = 0;
+    b->codec = c;
+    return 1;
+
+fail:
+    // leave a codec that is always at eof, rather than parse compressed bytes
+    builtin_error("%d: %s input not supported", b->fd, codec_names[type]);
+    c->type = CODEC_NONE;
+    c->in = NULL;
+    c->done = 1;
+    xfree(b->data);
+    b->data = xmalloc(CSV_BUFSIZE);
+    b->pos = b->len = 0;
+    b->seekable = 0;
+    b->codec = c;
+    return 0;
+}
+
+/*
+ *  Sets up decompression of the fd of a new buffer, for codec or, with
+ *  CODEC_AUTO, the one its first bytes call for. Those are peeked at with
+ *  pread on a seekable fd; otherwise they are read into the buffer, and are
+ *  parsed from there if the input turns out to be plain.
+ */
+static void
+init_codec(CSV_buffer *b, int codec)
 {
-    char c, *p;
-    char quote = 0;
-    size_t n = 0, alloced = 1024;
-    int ret;
+    unsigned char magic[4];
+    off_t off;
+    ssize_t nr;
+    size_t n = 0;
 
-    p = xmalloc(1024 * sizeof(char));
-    ctx->col++;
+    if ( codec == CODEC_NONE )
+        return;
+    if ( b->seekable && (off = lseek(b->fd, 0, SEEK_CUR)) >= 0 ) {
+        while ( n < sizeof(magic) && (nr = pread(b->fd, magic + n, sizeof(magic) - n, off + n)) > 0 )
+            n += nr;
+        if ( codec == CODEC_AUTO && (codec = detect_codec(magic, n)) == CODEC_NONE )
+            return;
+        if ( start_codec(b, codec, NULL, 0) )
+            b->codec->offset = off;
+        return;
+    }
+    if ( codec != CODEC_AUTO ) {
+        start_codec(b, codec, NULL, 0);
+        return;
+    }
 
-    while ( (ret = zreadc(ctx->fd, &c)) > 0 ) {
-        if (c == '\0' && ctx->fs != '\0' && ctx->rs != '\0')
-            continue;
-        if (quote) {
-            if (c == ctx->q) {
-                ret = zreadc(ctx->fd, &c);
-                if (c != ctx->q)
-                    quote = 0;
-                else
-                    p[n++] = c;
-            }
-            else
-                p[n++] = c;
+    // only wait for the first bytes: a writer may send a short row and then
+    // wait for an answer, so fewer bytes than a magic number are plain input
+    b->data = xmalloc(CSV_BUFSIZE);
+    nr = zread(b->fd, b->data, CSV_BUFSIZE);
+    b->reads++;
+    b->len = n = nr > 0 ? nr : 0;
+    if ( n < sizeof(magic) || (codec = detect_codec((unsigned char *) b->data, n)) == CODEC_NONE )
+        return;
+    start_codec(b, codec, b->data, n);
+}
+
+/*
+ *  returns 1 if the fd of b is compressed and seekable and is no longer
+ *  where the last read left it, having been reopened or moved with lseek,
+ *  so that what was decompressed ahead does not follow
+ */
+static int
+codec_moved(CSV_buffer *b)
+{
+    return b->codec && b->codec->offset >= 0 && lseek(b->fd, 0, SEEK_CUR) != b->codec->offset;
+}
+
+/*
+ *  Decompresses the next block of input into the buffer, reading more from
+ *  the fd as needed. Concatenated gzip members and zstd frames are read one
+ *  after another, like gzip -d does.
+ *
+ *  returns the number of bytes decompressed, 0 at the end of the input or
+ *  if it is corrupt
+ */
+static size_t
+decompress_buffer(CSV_buffer *b)
+{
+    CSV_codec *c = b->codec;
+    const char *error = NULL;
+    size_t out = 0;
+    ssize_t nr;
+
+    b->pos = b->len = 0;
+    while ( out == 0 && !c->done ) {
+        if ( c->in_pos == c->in_len && !c->eof ) {
+            nr = zread(b->fd, c->in, CSV_ZBUFSIZE);
+            b->reads++;
+            if ( c->offset >= 0 && nr > 0 )
+                c->offset += nr;
+            c->in_pos = 0;
+            c->in_len = nr > 0 ? nr : 0;
+            c->eof = nr <= 0;
+        }
+        if ( c->eof && c->in_pos == c->in_len && c->between ) {
+            c->done = 1;
+            break;
         }
-        if (!quote) {
-            if (c == ctx->fs || c == ctx->rs)
+        switch (c->type) {
+#if defined(CSV_GZIP)
+            case CODEC_GZIP: {
+                size_t before = c->in_pos;
+                int between = c->between;
+                int r;
+
+                c->z.next_in = (Bytef *) c->in + c->in_pos;
+                c->z.avail_in = c->in_len - c->in_pos;
+                c->z.next_out = (Bytef *) b->data;
+                c->z.avail_out = CSV_ZBUFSIZE;
+                r = inflate(&c->z, Z_NO_FLUSH);
+                c->in_pos = c->in_len - c->z.avail_in;
+                out = CSV_ZBUFSIZE - c->z.avail_out;
+                if ( out || c->in_pos > before )
+                    c->between = 0;
+                if ( r == Z_STREAM_END ) {
+                    inflateReset(&c->z);
+                    c->between = 1;
+                }
+                else if ( r == Z_BUF_ERROR && c->eof && c->in_pos == c->in_len )
+                    error = "unexpected end of gzip input";
+                else if ( r != Z_OK && r != Z_BUF_ERROR ) {
+                    // like gzip -d, ignore trailing garbage after a member
+                    if ( !between )
+                        error = c->z.msg ? c->z.msg : "corrupt gzip input";
+                    c->done = 1;
+                }
                 break;
-            if (ctx->rs == -1 && c == '\n') {
-                if (n > 0 && p[n-1] == '\r')
-                    n--;
+            }
+#endif
+#if defined(CSV_ZSTD)
+            case CODEC_ZSTD: {
+                ZSTD_inBuffer zin = { c->in, c->in_len, c->in_pos };
+                ZSTD_outBuffer zout = { b->data, CSV_ZBUFSIZE, 0 };
+                size_t r;
+
+                r = ZSTD_decompressStream(c->zd, &zout, &zin);
+                c->in_pos = zin.pos;
+                out = zout.pos;
+                if ( ZSTD_isError(r) )
+                    error = ZSTD_getErrorName(r);
+                else if ( out == 0 && c->eof && c->in_pos == c->in_len ) {
+                    if ( r != 0 )
+                        error = "unexpected end of zstd input";
+                    c->done = 1;
+                }
                 break;
             }
-            if (c == ctx->q)
-                quote = 1;
-            else
-                p[n++] = c;
+#endif
         }
-        if (n == alloced) {
-            p = xrealloc(p, (alloced += 1024) * sizeof(char));
+        if ( error ) {
+            builtin_error("%d: %s", b->fd, error);
+            c->done = 1;
         }
     }
+    b->len = out;
+    return out;
+}
 
-    p[n] = '\0';
-    *field = p;
+static void
+free_buffer(CSV_buffer *b)
+{
+    if ( b->mapped )
+        munmap(b->data, b->len);
+    else
+        xfree(b->data);
+    free_codec(b->codec);
+    xfree(b->arena.data);
+    xfree(b->slots);
+    free_index(b->index);
+    xfree(b);
+}
 
-    if (ret <= 0)
-        return -1;
+/*
+ *  With -m, regular files that are large enough are parsed straight from a
+ *  read-only mapping instead of being read into the buffer. It is not the
+ *  default, since a file truncated while it is mapped, such as a log being
+ *  rotated, gets bash killed with SIGBUS. The mapping is kept across
+ *  calls and redone if the file changes size or mtime. The file offset is
+ *  picked up again at the start of every call, since other readers may have
+ *  moved it, and sync_reader puts it right after the last row read.
+ */
+static void
+map_buffer(CSV_buffer *b, struct stat *st)
+{
+    void *p;
+    off_t off;
 
-    return c;
+    if ( !b->mapped || b->len != (size_t) st->st_size || b->mtime != st->st_mtime ) {
+        if ( (uintmax_t) st->st_size > SIZE_MAX )
+            return;
+        p = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, b->fd, 0);
+        if ( p == MAP_FAILED )
+            return;
+#if defined(MADV_SEQUENTIAL)
+        madvise(p, st->st_size, MADV_SEQUENTIAL);
+#endif
+        if ( b->mapped )
+            munmap(b->data, b->len);
+        else
+            xfree(b->data);
+        b->data = p;
+        b->len = st->st_size;
+        b->mtime = st->st_mtime;
+        b->mapped = 1;
+    }
+    off = lseek(b->fd, 0, SEEK_CUR);
+    b->pos = off < 0 ? 0 : (size_t) off > b->len ? b->len : off;
 }
 
-int
-skip_csv_row(CSV_context *ctx)
+/*
+ *  Drops the buffers of fds that have been closed or now refer to another
+ *  file, and returns the one for fd, creating it if needed. If fd is not
+ *  open, the buffer returned is empty and reads from it fail. Whether the
+ *  input is compressed is settled when the buffer is made, so codec only
+ *  matters on the first call for an fd, or the first after a compressed
+ *  file is reopened or its offset moved. With map, a large regular file is
+ *  mapped.
+ */
+static CSV_buffer *
+get_buffer(int fd, int codec, int map)
 {
+    CSV_buffer *b, **bp, *found = NULL;
+    struct stat st, fst;
+    int fd_ok;
 
-    int ret, quote = 0;
-    char c;
-
-    while ( (ret = zreadc(ctx->fd, &c)) >= 0 ) {
-        if (quote) {
-            if (c == ctx->q) {
-                ret = zreadc(ctx->fd, &c);
-                if (c != ctx->q)
-                    quote = 0;
+    fd_ok = fstat(fd, &fst) == 0;
+    for (bp = &buffers; (b = *bp); ) {
+        if ( b->fd == fd ) {
+            if ( fd_ok && fst.st_dev == b->dev && fst.st_ino == b->ino && !codec_moved(b) ) {
+                found = b;
+                bp = &b->next;
+                continue;
             }
         }
-        if (!quote) {
-            if (c == ctx->rs || ctx->rs == -1 && c == '\n')
-                break;
-            if (c == ctx->q)
-                quote = 1;
+        else if ( fstat(b->fd, &st) == 0 && st.st_dev == b->dev && st.st_ino == b->ino ) {
+            bp = &b->next;
+            continue;
+        }
+        *bp = b->next;
+        free_buffer(b);
+    }
+
+    if ( (b = found) == NULL ) {
+        b = xmalloc(sizeof(CSV_buffer));
+        b->fd = fd;
+        b->dev = fd_ok ? fst.st_dev : 0;
+        b->ino = fd_ok ? fst.st_ino : 0;
+        b->seekable = fd_ok && lseek(fd, 0, SEEK_CUR) >= 0;
+        b->mapped = 0;
+        b->mtime = 0;
+        b->data = NULL;
+        b->pos = b->len = 0;
+        b->arena.data = NULL;
+        b->arena.size = b->arena.used = 0;
+        b->arena.allocs = 0;
+        b->arena.mapped = 0;
+        b->slots = NULL;
+        b->slots_size = 0;
+        b->index = NULL;
+        b->codec = NULL;
+        b->reads = 0;
+        b->next = buffers;
+        buffers = b;
+        if ( fd_ok )
+            init_codec(b, codec);
+    }
+
+    if ( b->codec )
+        ;
+    else if ( map && fd_ok && S_ISREG(fst.st_mode) && fst.st_size >= CSV_MMAP_MIN )
+        map_buffer(b, &fst);
+    else if ( b->mapped ) {
+        // no -m this time, or the file shrunk below the limit; go back to
+        // reading
+        munmap(b->data, b->len);
+        b->mapped = 0;
+        b->data = NULL;
+        b->pos = b->len = 0;
+    }
+    if ( b->data == NULL )
+        b->data = xmalloc(CSV_BUFSIZE);
+    return b;
+}
+
+/*
+ *  Throws away whatever has been read ahead from fd. On a seekable fd the
+ *  bytes are given back first, so nothing is lost.
+ */
+void
+flush_buffer(int fd)
+{
+    CSV_buffer *b, **bp;
+
+    for (bp = &buffers; (b = *bp); bp = &b->next) {
+        if ( b->fd == fd ) {
+            if ( b->seekable && b->pos < b->len && !b->mapped )
+                lseek(fd, -(off_t) (b->len - b->pos), SEEK_CUR);
+            *bp = b->next;
+            free_buffer(b);
+            return;
+        }
+    }
+}
+
+/*
+ *  Sets up the read-ahead buffer for ctx->fd, and the stop sets for the
+ *  scanner. NUL bytes are dropped unless one of the separators is NUL, and a
+ *  NUL quote character disables quoting.
+ */
+void
+init_reader(CSV_context *ctx)
+{
+    unsigned char eol;
+
+    if ( scan_bytes == NULL )
+        init_scanner();
+    ctx->in = get_buffer(ctx->fd, ctx->codec, ctx->map);
+    ctx->arena = &ctx->in->arena;
+    ctx->arena->used = 0;
+
+    ctx->drop_nul = ctx->fs != '\0' && ctx->rs != '\0';
+    eol = ctx->rs == -1 ? '\n' : ctx->rs;
+    ctx->stop[0] = ctx->fs;
+    ctx->stop[1] = eol;
+    ctx->stop[2] = ctx->q ? ctx->q : eol;
+    ctx->stop[3] = ctx->drop_nul ? '\0' : eol;
+    ctx->qstop[0] = ctx->qstop[1] = ctx->q;
+    ctx->qstop[2] = ctx->qstop[3] = ctx->drop_nul ? '\0' : ctx->q;
+}
+
+/*
+ *  returns the number of unparsed bytes in the buffer, reading more from the
+ *  fd if it is empty. 0 means eof or error.
+ */
+static size_t
+fill_buffer(CSV_buffer *in)
+{
+    ssize_t nr;
+
+    if ( in->pos < in->len )
+        return in->len - in->pos;
+    if ( in->mapped )
+        return 0;
+    if ( in->codec )
+        return decompress_buffer(in);
+    nr = zread(in->fd, in->data, CSV_BUFSIZE);
+    in->reads++;
+    in->pos = 0;
+    in->len = nr > 0 ? nr : 0;
+    return in->len;
+}
+
+/*
+ *  Gives back the bytes that were read ahead but not parsed, so that other
+ *  readers of a seekable fd start right after the last row. On pipes and
+ *  other unseekable fds they stay in the buffer for the next call.
+ */
+void
+sync_reader(CSV_context *ctx)
+{
+    CSV_buffer *in = ctx->in;
+    off_t off = in->len - in->pos;
+
+    if ( in->mapped )
+        lseek(in->fd, in->pos, SEEK_SET);
+    else if ( off == 0 || in->seekable && lseek(in->fd, -off, SEEK_CUR) >= 0 )
+        in->pos = in->len = 0;
+
+#if defined(CSV_DEBUG)
+    {
+        // number of arena allocations so far on this fd
+        char ibuf[INT_STRLEN_BOUND (intmax_t) + 1];
+        bind_variable("CSV_ALLOCS", fmtulong(ctx->arena->allocs, 10, ibuf, sizeof(ibuf), 0), 0);
+    }
+#endif
+}
+
+/*
+ *  Grows an anonymous mapping from old to size bytes. Parser threads use
+ *  this instead of xrealloc, since bash's malloc is not thread safe. Like
+ *  xrealloc, it does not return if there is no memory left.
+ */
+static char *
+map_grow(char *p, size_t old, size_t size)
+{
+    char *q;
+    static const char msg[] = "csv: cannot allocate memory for parser thread\n";
+
+    q = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( q == MAP_FAILED ) {
+        write(2, msg, sizeof(msg) - 1);
+        _exit(2);
+    }
+    if ( p ) {
+        memcpy(q, p, old);
+        munmap(p, old);
+    }
+    return q;
+}
+
+/*
+ *  Makes room for at least need more bytes in the arena, doubling its size
+ *  as often as needed.
+ */
+static inline void
+arena_reserve(CSV_arena *a, size_t need)
+{
+    size_t size;
+
+    if ( a->used + need <= a->size )
+        return;
+    for (size = a->size ? a->size : 4096; size < a->used + need; size *= 2)
+        ;
+    if ( a->mapped )
+        a->data = map_grow(a->data, a->size, size);
+    else
+        a->data = xrealloc(a->data, size);
+    a->size = size;
+    a->allocs++;
+}
+
+/*
+ *  Starts a new row; the values of the fields of the previous row are gone.
+ *
+ *  returns 0 if there is nothing left to read
+ */
+static int find_row(CSV_context *);
+static int skip_csv(CSV_context *, int);
+
+static inline int
+start_row(CSV_context *ctx)
+{
+    ctx->col = -1;
+    ctx->arena->used = 0;
+    ctx->replay = 0;
+    if ( ctx->npreds )
+        return find_row(ctx);
+    return fill_buffer(ctx->in) > 0;
+}
+
+/*
+ *  Without a quote character, as with -t, a field is just the run up to the
+ *  next separator, and NUL bytes are all that can stop the scanner inside
+ *  one. Works like read_csv_field otherwise.
+ */
+static int
+read_plain_field(CSV_field *field, CSV_context *ctx)
+{
+    CSV_buffer *in = ctx->in;
+    CSV_arena *a = ctx->arena;
+    char *p = a->data + a->used;
+    size_t n = 0, len;
+    int c, sep = -1;
+
+    while ( fill_buffer(in) > 0 ) {
+        len = scan_bytes(in->data + in->pos, in->len - in->pos, ctx->stop);
+        if ( a->used + n + len + 2 > a->size ) {
+            arena_reserve(a, n + len + 2);
+            p = a->data + a->used;
+        }
+        memcpy(p + n, in->data + in->pos, len);
+        n += len;
+        in->pos += len;
+        if ( in->pos == in->len )
+            continue;
+
+        c = (unsigned char) in->data[in->pos++];
+        if (c == ctx->fs || c == ctx->rs) {
+            sep = c;
+            break;
+        }
+        if (ctx->rs == -1 && c == '\n') {
+            if (n > 0 && p[n-1] == '\r')
+                n--;
+            sep = c;
+            break;
+        }
+        // a NUL byte, dropped
+    }
+
+    p[n] = '\0';
+    field->off = a->used;
+    field->len = n;
+    a->used += n + 1;
+
+    return sep;
+}
+
+/*
+ *  Fixed width fields, for -W. The field numbered ctx->col is the next
+ *  ctx->widths[ctx->col] bytes of the row, copied to p unless p is NULL,
+ *  and *np is set to the number of bytes taken. Nothing is scanned for but
+ *  the row separator, in case the row is shorter, and the rest of the row
+ *  after the last field is skipped.
+ *
+ *  returns the separator, like read_csv_field: fs after all but the last
+ *  field of a row
+ */
+static int
+slice_fixed(char *p, size_t *np, CSV_context *ctx)
+{
+    CSV_buffer *in = ctx->in;
+    size_t width = ctx->widths[ctx->col], n = 0, len;
+    int eol = ctx->rs == -1 ? '\n' : ctx->rs;
+    char *e;
+
+    while ( n < width && fill_buffer(in) > 0 ) {
+        len = in->len - in->pos;
+        if ( len > width - n )
+            len = width - n;
+        e = memchr(in->data + in->pos, eol, len);
+        if ( e )
+            len = e - (in->data + in->pos);
+        if ( p )
+            memcpy(p + n, in->data + in->pos, len);
+        n += len;
+        in->pos += len;
+        if ( e ) {
+            in->pos++;
+            if ( p && ctx->rs == -1 && n > 0 && p[n-1] == '\r' )
+                n--;
+            *np = n;
+            return eol;
+        }
+    }
+    *np = n;
+    if ( n < width )
+        return -1;
+    if ( ctx->col == ctx->nwidths - 1 )
+        return skip_csv(ctx, 1);
+    return ctx->fs;
+}
+
+static int
+read_fixed_field(CSV_field *field, CSV_context *ctx)
+{
+    CSV_arena *a = ctx->arena;
+    int sep;
+
+    arena_reserve(a, ctx->widths[ctx->col] + 1);
+    sep = slice_fixed(a->data + a->used, &field->len, ctx);
+    a->data[a->used + field->len] = '\0';
+    field->off = a->used;
+    a->used += field->len + 1;
+    return sep;
+}
+
+/*
+ *  field is set to the next field separated either by the field separator or
+ *  row separator, appended to the row's arena. The value is valid until the
+ *  next call to start_row.
+ *
+ *  returns the separator (fs or rs or '\n') or -1 if eof or error
+ * TODO: print error messages
+ */
+
+int
+read_csv_field(CSV_field *field, CSV_context *ctx)
+{
+    CSV_buffer *in = ctx->in;
+    CSV_arena *a = ctx->arena;
+    char *p;
+    size_t n = 0, len;
+    int c, quote = 0, sep = -1;
+
+    ctx->col++;
+    if ( ctx->widths )
+        return read_fixed_field(field, ctx);
+    arena_reserve(a, 1);
+    if ( ctx->q == '\0' )
+        return read_plain_field(field, ctx);
+    p = a->data + a->used;
+
+    while ( fill_buffer(in) > 0 ) {
+        // copy the run up to the next interesting byte in one go
+        len = scan_bytes(in->data + in->pos, in->len - in->pos, quote ? ctx->qstop : ctx->stop);
+        if ( a->used + n + len + 2 > a->size ) {
+            arena_reserve(a, n + len + 2);
+            p = a->data + a->used;
+        }
+        memcpy(p + n, in->data + in->pos, len);
+        n += len;
+        in->pos += len;
+        if ( in->pos == in->len )
+            continue;
+
+        c = (unsigned char) in->data[in->pos++];
+        if (c == '\0' && ctx->drop_nul)
+            continue;
+        if (quote) {
+            // c is the quote character; a doubled quote is a literal quote
+            if ( fill_buffer(in) > 0 && (unsigned char) in->data[in->pos] == ctx->q ) {
+                p[n++] = c;
+                in->pos++;
+            }
+            else
+                quote = 0;
+            continue;
+        }
+        if (c == ctx->fs || c == ctx->rs) {
+            sep = c;
+            break;
+        }
+        if (ctx->rs == -1 && c == '\n') {
+            if (n > 0 && p[n-1] == '\r')
+                n--;
+            sep = c;
+            break;
+        }
+        quote = 1;
+    }
+
+    p[n] = '\0';
+    field->off = a->used;
+    field->len = n;
+    a->used += n + 1;
+
+    return sep;
+}
+
+/*
+ *  Forgets the value of the last field read, if it is not needed anyway.
+ */
+static inline void
+drop_field(CSV_field *field, CSV_context *ctx)
+{
+    ctx->arena->used = field->off;
+}
+
+/*
+ *  Moves past the rest of the current field, or the rest of the row if
+ *  whole_row is set, without copying anything.
+ *
+ *  returns the separator or -1 if eof or error
+ */
+static int
+skip_csv(CSV_context *ctx, int whole_row)
+{
+    CSV_buffer *in = ctx->in;
+    int c, quote = 0;
+    size_t len;
+
+    if ( ctx->widths && !whole_row )
+        return slice_fixed(NULL, &len, ctx);
+
+    while ( fill_buffer(in) > 0 ) {
+        len = scan_bytes(in->data + in->pos, in->len - in->pos, quote ? ctx->qstop : ctx->stop);
+        in->pos += len;
+        if ( in->pos == in->len )
+            continue;
+
+        c = (unsigned char) in->data[in->pos++];
+        if (quote) {
+            if (c != ctx->q)
+                continue;
+            if ( fill_buffer(in) > 0 && (unsigned char) in->data[in->pos] == ctx->q )
+                in->pos++;
+            else
+                quote = 0;
+        }
+        else if (c == ctx->fs && !whole_row || is_rs(c, ctx))
+            return c;
+        else if (c == ctx->q && c != ctx->fs && !(c == '\0' && ctx->drop_nul))
+            quote = 1;
+    }
+    return -1;
+}
+
+int
+skip_csv_row(CSV_context *ctx)
+{
+    if ( ctx->replay )
+        return ctx->row_end;
+    return skip_csv(ctx, 1);
+}
+
+/*
+ *  Reads the next field into the arena if it is selected with -f, and skips
+ *  over it without copying it otherwise. Either way ctx->col is the number
+ *  of that field afterwards. When the row was already read by find_row, the
+ *  field is taken from there.
+ *
+ *  returns the separator, like read_csv_field
+ */
+int
+next_field(CSV_field *field, CSV_context *ctx)
+{
+    if ( ctx->replay ) {
+        if ( ++ctx->col >= ctx->nslots )
+            return ctx->row_end;
+        *field = ctx->in->slots[ctx->col].field;
+        return ctx->in->slots[ctx->col].sep;
+    }
+    if ( !skip_field(ctx->col + 1, ctx) )
+        return read_csv_field(field, ctx);
+    ctx->col++;
+    return skip_csv(ctx, 0);
+}
+
+/*
+ *  Like the -f bitmap, the predicates and the bitmap of the fields they look
+ *  at are kept until the next call.
+ */
+static CSV_pred *pred_storage = NULL;
+static unsigned char *pcut_storage = NULL;
+
+/*
+ *  Parses the -w predicate s, N followed by one of = != ^= for string
+ *  equality, inequality and prefix, or == < <= > >= for numbers, and the
+ *  value to compare with, and adds it to ctx. The string is not copied.
+ *
+ *  returns 0 if the predicate is illegal
+ */
+static int
+parse_predicate(char *s, int or, CSV_context *ctx)
+{
+    static const struct { const char *op; int code; } ops[] = {
+        { "!=", PRED_NE }, { "^=", PRED_PREFIX }, { "==", PRED_NUM_EQ },
+        { "<=", PRED_LE }, { ">=", PRED_GE }, { "=", PRED_EQ },
+        { "<", PRED_LT }, { ">", PRED_GT }, { NULL, 0 }
+    };
+    CSV_pred *p;
+    char *end;
+    int i, col;
+
+    if ( (col = parse_field_number(&s)) < 0 )
+        return 0;
+    for (i = 0; ops[i].op; ++i)
+        if ( strncmp(s, ops[i].op, strlen(ops[i].op)) == 0 )
+            break;
+    if ( ops[i].op == NULL )
+        return 0;
+    s += strlen(ops[i].op);
+
+    if ( ctx->npreds == 0 )
+        ctx->plast = -1;
+    ctx->preds = pred_storage = xrealloc(pred_storage, (ctx->npreds + 1) * sizeof(CSV_pred));
+    p = &ctx->preds[ctx->npreds];
+    p->col = col;
+    p->op = ops[i].code;
+    p->or = or && ctx->npreds > 0;
+    p->str = s;
+    p->len = strlen(s);
+    if ( p->op >= PRED_NUM_EQ ) {
+        p->num = strtod(s, &end);
+        if ( end == s || *end != '\0' )
+            return 0;
+    }
+    ctx->npreds++;
+
+    if ( col > ctx->plast ) {
+        pcut_storage = xrealloc(pcut_storage, col / 8 + 1);
+        memset(pcut_storage + (ctx->plast < 0 ? 0 : ctx->plast / 8 + 1), 0,
+               col / 8 + 1 - (ctx->plast < 0 ? 0 : ctx->plast / 8 + 1));
+        ctx->plast = col;
+    }
+    ctx->pcut = pcut_storage;
+    ctx->pcut[col >> 3] |= 1 << (col & 7);
+    return 1;
+}
+
+static int
+test_predicate(CSV_pred *p, CSV_context *ctx)
+{
+    const char *value = "";
+    char *end;
+    size_t len = 0;
+    double d;
+
+    if ( p->col < ctx->nslots ) {
+        value = field_value(ctx, ctx->in->slots[p->col].field);
+        len = ctx->in->slots[p->col].field.len;
+    }
+    switch (p->op) {
+        case PRED_EQ:
+            return len == p->len && memcmp(value, p->str, len) == 0;
+        case PRED_NE:
+            return len != p->len || memcmp(value, p->str, len) != 0;
+        case PRED_PREFIX:
+            return len >= p->len && memcmp(value, p->str, p->len) == 0;
+    }
+    // numeric tests fail for fields that are not numbers
+    d = strtod(value, &end);
+    if ( len == 0 || end != value + len )
+        return 0;
+    switch (p->op) {
+        case PRED_NUM_EQ:   return d == p->num;
+        case PRED_LT:       return d < p->num;
+        case PRED_LE:       return d <= p->num;
+        case PRED_GT:       return d > p->num;
+        default:            return d >= p->num;
+    }
+}
+
+/*
+ *  returns 1 if all the predicates of any of the alternatives hold for the
+ *  row in slots
+ */
+static int
+match_row(CSV_context *ctx)
+{
+    int i = 0, ok;
+
+    while ( i < ctx->npreds ) {
+        ok = 1;
+        do {
+            if ( ok && !test_predicate(&ctx->preds[i], ctx) )
+                ok = 0;
+        } while ( ++i < ctx->npreds && !ctx->preds[i].or );
+        if ( ok )
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ *  Reads rows until one matches the predicates. Each row is read into the
+ *  slots, with the fields selected with -f and those the predicates look at
+ *  in the arena, and the rest skipped. Rows that do not match are dropped
+ *  without any allocation once the arena and slots are large enough. The
+ *  matching row is then handed out again by next_field.
+ *
+ *  returns 0 if no row matched before eof
+ */
+static int
+find_row(CSV_context *ctx)
+{
+    CSV_buffer *in = ctx->in;
+    CSV_slot *slot;
+    int sep, col, last = ctx->last;
+
+    if ( last < ctx->plast )
+        last = ctx->plast;
+    while ( fill_buffer(in) > 0 ) {
+        ctx->col = -1;
+        ctx->arena->used = 0;
+        do {
+            if ( ctx->col >= last ) {
+                sep = skip_csv(ctx, 1);
+                break;
+            }
+            col = ctx->col + 1;
+            if ( col >= in->slots_size ) {
+                in->slots_size = in->slots_size ? 2 * in->slots_size : 64;
+                in->slots = xrealloc(in->slots, in->slots_size * sizeof(CSV_slot));
+            }
+            slot = &in->slots[col];
+            if ( !skip_field(col, ctx) || col <= ctx->plast && ctx->pcut[col >> 3] & 1 << (col & 7) )
+                sep = read_csv_field(&slot->field, ctx);
+            else {
+                ctx->col++;
+                sep = skip_csv(ctx, 0);
+                slot->field.off = slot->field.len = 0;
+            }
+            slot->sep = sep;
+        } while ( sep >= 0 && !is_rs(sep, ctx) );
+
+        ctx->nslots = ctx->col + 1;
+        ctx->row_end = sep;
+        if ( match_row(ctx) ) {
+            ctx->col = -1;
+            ctx->replay = 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ *  Keys for reading rows into an associative array with -a: the name in
+ *  the header for each field, or its number if there is none, with the
+ *  hash bash's hash tables use. They are made once and kept for as long as
+ *  the same header is used with the same contents, so that reading a row
+ *  does not look up every field in the header's list of elements.
+ */
+typedef struct CSV_keys {
+    ARRAY *header;          // header the keys were made for, or NULL
+    int nelem;              // number of elements in header
+    int n, size;            // number of keys, and allocated
+    char **names;           // copies of the header's elements, to notice changes
+    char **keys;            // key of each field
+    unsigned int *hash;     // hash_string() of each key, to find repeats
+    int *first;             // lowest field with the same key
+    unsigned long *stamp;   // last row a field with this key was set in
+    int nfields, fields_size;
+    CSV_field *fields;      // fields of the row being read
+    int *cols;              // and their numbers
+} CSV_keys;
+
+static CSV_keys header_keys = { NULL, 0, 0, 0 };
+static unsigned long keys_row = 0;
+
+/*
+ *  Adds keys for fields up to and including col.
+ */
+static void
+extend_keys(CSV_keys *k, int col)
+{
+    char ibuf[INT_STRLEN_BOUND (intmax_t) + 1]; // used by fmtulong
+    int i, j;
+
+    if ( col >= k->size ) {
+        k->size = col + 1 > 2 * k->size ? col + 1 : 2 * k->size;
+        k->names = xrealloc(k->names, k->size * sizeof(char *));
+        k->keys = xrealloc(k->keys, k->size * sizeof(char *));
+        k->hash = xrealloc(k->hash, k->size * sizeof(unsigned int));
+        k->first = xrealloc(k->first, k->size * sizeof(int));
+        k->stamp = xrealloc(k->stamp, k->size * sizeof(unsigned long));
+    }
+    for (i = k->n; i <= col; ++i) {
+        k->names[i] = NULL;
+        k->keys[i] = savestring(fmtulong(i, 10, ibuf, sizeof(ibuf), 0));
+        k->hash[i] = hash_string(k->keys[i]);
+        k->stamp[i] = 0;
+        for (j = 0; j < i && (k->hash[j] != k->hash[i] || !STREQ(k->keys[j], k->keys[i])); ++j)
+            ;
+        k->first[i] = j;
+    }
+    if ( col >= k->n )
+        k->n = col + 1;
+}
+
+/*
+ *  returns the keys for header, remaking them if it is not the header they
+ *  were made for or has changed since
+ */
+static CSV_keys *
+resolve_keys(ARRAY *header)
+{
+    CSV_keys *k = &header_keys;
+    ARRAY_ELEMENT *ae;
+    arrayind_t i;
+    int j;
+
+    if ( k->header == header && (header == NULL || k->nelem == array_num_elements(header)) ) {
+        if ( header == NULL )
+            return k;
+        for (ae = element_forw(header->head); ae != header->head; ae = element_forw(ae)) {
+            i = element_index(ae);
+            if ( i >= k->n || k->names[i] == NULL || !STREQ(k->names[i], element_value(ae)) )
+                break;
+        }
+        if ( ae == header->head )
+            return k;
+    }
+
+    for (j = 0; j < k->n; ++j) {
+        if ( k->keys[j] != k->names[j] )
+            xfree(k->keys[j]);
+        xfree(k->names[j]);
+    }
+    k->n = 0;
+    k->header = header;
+    k->nelem = header ? array_num_elements(header) : 0;
+    if ( header == NULL || array_empty(header) )
+        return k;
+
+    extend_keys(k, array_max_index(header));
+    for (ae = element_forw(header->head); ae != header->head; ae = element_forw(ae)) {
+        i = element_index(ae);
+        k->names[i] = savestring(element_value(ae));
+        if ( k->names[i][0] != '\0' ) {
+            xfree(k->keys[i]);
+            k->keys[i] = k->names[i];
+            k->hash[i] = hash_string(k->keys[i]);
+        }
+    }
+    for (i = 0; i < k->n; ++i) {
+        for (j = 0; j < i && (k->hash[j] != k->hash[i] || !STREQ(k->keys[j], k->keys[i])); ++j)
+            ;
+        k->first[i] = j;
+    }
+    return k;
+}
+
+/*
+ *  Sets the element key of an associative array to value, reusing the
+ *  element if there is one, so that its key need not be copied.
+ */
+static void
+set_assoc_value(HASH_TABLE *t, char *key, char *value)
+{
+    BUCKET_CONTENTS *b;
+
+    if ( (b = hash_search(key, t, 0)) ) {
+        xfree(b->data);
+        b->data = savestring(value);
+        return;
+    }
+    assoc_insert(t, savestring(key), value);
+}
+
+/*
+ *  Reads a row into an associative array, keyed by the header. Elements of
+ *  the previous row are reused for the fields that have the same keys, and
+ *  the array is only emptied if that leaves elements the row did not set.
+ *  Arrays with attributes that change values on assignment go through
+ *  bind_assoc_variable instead.
+ */
+static int
+read_into_assoc(SHELL_VAR *array, ARRAY *header, CSV_context *ctx)
+{
+    HASH_TABLE *t = assoc_cell(array);
+    CSV_keys *k;
+    CSV_field field;
+    int ret, i, col, nset, direct;
+
+    direct = array->assign_func == NULL
+             && (array->attributes & (att_integer|att_uppercase|att_lowercase|att_capcase)) == 0;
+    if ( !start_row(ctx) ) {
+        assoc_flush(t);
+        return EXECUTION_FAILURE;
+    }
+
+    k = resolve_keys(header);
+    k->nfields = 0;
+    do {
+        if ( ctx->col >= ctx->last ) {
+            skip_csv_row(ctx);
+            break;
+        }
+        ret = next_field(&field, ctx);
+        if ( !skip_field(ctx->col, ctx) ) {
+            if ( k->nfields == k->fields_size ) {
+                k->fields_size = k->fields_size ? 2 * k->fields_size : 64;
+                k->fields = xrealloc(k->fields, k->fields_size * sizeof(CSV_field));
+                k->cols = xrealloc(k->cols, k->fields_size * sizeof(int));
+            }
+            k->fields[k->nfields] = field;
+            k->cols[k->nfields++] = ctx->col;
+        }
+    } while ( ret >= 0 && !is_rs(ret, ctx) );
+    if ( k->nfields && k->cols[k->nfields - 1] >= k->n )
+        extend_keys(k, k->cols[k->nfields - 1]);
+
+    if ( !direct ) {
+        assoc_flush(t);
+        for (i = 0; i < k->nfields; ++i)
+            bind_assoc_variable(array, array->name, savestring(k->keys[k->cols[i]]),
+                                field_value(ctx, k->fields[i]), 0);
+        return EXECUTION_SUCCESS;
+    }
+
+    keys_row++;
+    for (i = nset = 0; i < k->nfields; ++i) {
+        col = k->cols[i];
+        if ( k->stamp[k->first[col]] != keys_row ) {
+            k->stamp[k->first[col]] = keys_row;
+            nset++;
+        }
+        set_assoc_value(t, k->keys[col], field_value(ctx, k->fields[i]));
+    }
+    if ( t->nentries != nset ) {
+        // some elements are left over from before
+        assoc_flush(t);
+        for (i = 0; i < k->nfields; ++i)
+            set_assoc_value(t, k->keys[k->cols[i]], field_value(ctx, k->fields[i]));
+    }
+    return EXECUTION_SUCCESS;
+}
+
+int
+read_into_array(SHELL_VAR *array, SHELL_VAR *header, CSV_context *ctx) {
+
+    int ret, npreds;
+    CSV_field field;
+    
+    if ( header && array_empty(array_cell(header)) ) {
+        // the header row is not filtered
+        npreds = ctx->npreds;
+        ctx->npreds = 0;
+        read_into_array(header, NULL, ctx);
+        ctx->npreds = npreds;
+    }
+
+    if ( assoc_p(array) )
+        return read_into_assoc(array, header ? array_cell(header) : NULL, ctx);
+
+    if ( !start_row(ctx) )
+        return EXECUTION_FAILURE;
+    do {
+        if ( ctx->col >= ctx->last ) {
+            skip_csv_row(ctx);
+            break;
+        }
+        ret = next_field(&field, ctx);
+        if ( !skip_field(ctx->col, ctx) ) {
+            bind_array_element(array, ctx->col, field_value(ctx, field), 0);
+            drop_field(&field, ctx);
+        }
+    } while ( ret >= 0 && !is_rs(ret, ctx) );
+    return EXECUTION_SUCCESS;
+
+}
+
+/*
+ *  Reads the rest of a row, setting fields[n] to the nth selected field.
+ *  Rows with fewer fields get empty strings for the missing ones. The values
+ *  are all kept in the arena, after whatever it held already.
+ *
+ *  returns the separator that ended the row, or -1 if eof or error
+ */
+static int
+read_row(CSV_field *fields, int ncolumns, CSV_context *ctx)
+{
+    CSV_arena *a = ctx->arena;
+    int k = 0, sep;
+
+    ctx->col = -1;
+    do {
+        sep = next_field(&fields[k], ctx);
+        if ( !skip_field(ctx->col, ctx) )
+            k++;
+    } while ( k < ncolumns && ctx->col < ctx->last && sep >= 0 && !is_rs(sep, ctx) );
+
+    // all columns filled, throw away the rest of the row
+    if ( sep >= 0 && !is_rs(sep, ctx) )
+        sep = skip_csv_row(ctx);
+    for (; k < ncolumns; ++k) {
+        arena_reserve(a, 1);
+        a->data[a->used] = '\0';
+        fields[k].off = a->used++;
+        fields[k].len = 0;
+    }
+    return sep;
+}
+
+/*
+ *  Reads rows until eof, or until count rows have been read if count is
+ *  greater than 0, and sets element row, row + 1, ... of columns[n] to the
+ *  nth selected field of each row.
+ *
+ *  returns the number of rows read
+ */
+static intmax_t
+append_rows(ARRAY **columns, int ncolumns, intmax_t row, intmax_t count, CSV_context *ctx) {
+
+    intmax_t n;
+    int k, sep;
+    CSV_field *fields = xmalloc(ncolumns * sizeof(CSV_field));
+
+    for (n = 0; count <= 0 || n < count; ++n) {
+        if ( !start_row(ctx) )
+            break;
+        sep = read_row(fields, ncolumns, ctx);
+        for (k = 0; k < ncolumns; ++k)
+            array_insert(columns[k], row + n, field_value(ctx, fields[k]));
+        if ( sep == -1 ) {
+            ++n;
+            break;
+        }
+    }
+    xfree(fields);
+    return n;
+}
+
+/*
+ *  A parser thread. It first looks for row boundaries in the part of the
+ *  file from..to, then parses the rows of the piece given to it into its own
+ *  arenas. Threads never touch shell state or bash's malloc; the main thread
+ *  moves what they found into the arrays.
+ */
+typedef struct CSV_worker {
+    pthread_t thread;
+    int started;        // 1 if thread has to be joined
+    CSV_context ctx;    // copy of the caller's, reading from in
+    CSV_buffer in;      // the piece to parse, over the caller's mapping
+    CSV_arena fields;   // ncolumns CSV_field records per row
+    int ncolumns;
+    size_t from, to;    // part of the mapping to scan
+    size_t quotes;      // number of quote characters between from and to
+    size_t eol[2];      // first row separator after an even and odd number
+                        // of quotes, or (size_t) -1 if there is none
+    intmax_t rows;      // number of rows parsed
+    int sep;            // separator that ended the last row parsed
+} CSV_worker;
+
+#define CSV_NONE ((size_t) -1)
+
+/*
+ *  Quoting is all about parity here: read_csv_field flips between quoted
+ *  and unquoted on every quote character, a doubled quote flipping it twice.
+ *  So a row separator ends a row if an even number of quotes came before it
+ *  in the file. Not knowing what came before, remember the first row
+ *  separator for both cases.
+ */
+static void *
+scan_chunk(void *arg)
+{
+    CSV_worker *w = arg;
+    CSV_context *ctx = &w->ctx;
+    const char *p = w->in.data;
+    unsigned char set[4];
+    size_t i, len;
+    int eol = ctx->rs == -1 ? '\n' : ctx->rs;
+
+    set[0] = set[1] = eol;
+    set[2] = set[3] = ctx->q ? ctx->q : eol;
+    w->quotes = 0;
+    w->eol[0] = w->eol[1] = CSV_NONE;
+    for (i = w->from; i < w->to; ++i) {
+        len = scan_bytes(p + i, w->to - i, set);
+        if ( (i += len) == w->to )
+            break;
+        if ( (unsigned char) p[i] != eol )
+            w->quotes++;
+        else if ( w->eol[w->quotes & 1] == CSV_NONE ) {
+            w->eol[w->quotes & 1] = i;
+            if ( w->eol[!(w->quotes & 1)] != CSV_NONE )
+                set[0] = set[1] = set[2];   // only counting quotes now
+        }
+    }
+    return NULL;
+}
+
+static void *
+parse_chunk(void *arg)
+{
+    CSV_worker *w = arg;
+    size_t rowsize = w->ncolumns * sizeof(CSV_field);
+
+    w->rows = 0;
+    w->sep = -1;
+    while ( fill_buffer(&w->in) > 0 ) {
+        arena_reserve(&w->fields, rowsize);
+        w->sep = read_row((CSV_field *) (w->fields.data + w->fields.used), w->ncolumns, &w->ctx);
+        w->fields.used += rowsize;
+        w->rows++;
+    }
+    return NULL;
+}
+
+/*
+ *  Starts fn for every worker, each in its own thread, or runs it in this
+ *  one if the thread could not be started. The threads start with every
+ *  signal blocked, so bash's handlers only ever run on the main thread.
+ */
+static void
+run_workers(CSV_worker *w, int n, void *(*fn)(void *))
+{
+    sigset_t all, old;
+    int i;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (i = 0; i < n; ++i)
+        w[i].started = pthread_create(&w[i].thread, NULL, fn, &w[i]) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    for (i = 0; i < n; ++i)
+        if ( !w[i].started )
+            fn(&w[i]);
+}
+
+static void
+free_worker(CSV_worker *w)
+{
+    if ( w->started )
+        pthread_join(w->thread, NULL);
+    w->started = 0;
+    if ( w->in.arena.data )
+        munmap(w->in.arena.data, w->in.arena.size);
+    if ( w->fields.data )
+        munmap(w->fields.data, w->fields.size);
+}
+
+/*
+ *  Bulk mode on the rest of a mapped file, using up to jobs threads. The
+ *  file is cut into equal parts, the threads find where the first row of
+ *  each part starts, and then parse the pieces between those row starts.
+ *  The main thread appends the rows of each piece to the arrays as soon as
+ *  the thread parsing it is done, in file order, so the result is the same
+ *  as reading the file with append_rows. Should a piece not end at the end
+ *  of a row, which would be a bug, the rest of the file is read that way.
+ *
+ *  returns the number of rows read
+ */
+static intmax_t
+append_rows_parallel(ARRAY **columns, int ncolumns, int jobs, CSV_context *ctx) {
+
+    CSV_buffer *in = ctx->in;
+    CSV_worker *w;
+    CSV_field *f;
+    size_t start = in->pos, end = in->len, *bound;
+    intmax_t row = 0, r;
+    int i, k, n, parity, failed = 0;
+
+    w = xmalloc(jobs * sizeof(CSV_worker));
+    bound = xmalloc((jobs + 1) * sizeof(size_t));
+    for (i = 0; i < jobs; ++i) {
+        w[i].started = 0;
+        w[i].ctx = *ctx;
+        w[i].ctx.in = &w[i].in;
+        w[i].ctx.arena = &w[i].in.arena;
+        w[i].in = *in;
+        w[i].in.arena.data = NULL;
+        w[i].in.arena.size = w[i].in.arena.used = 0;
+        w[i].in.arena.mapped = 1;
+        w[i].fields = w[i].in.arena;
+        w[i].ncolumns = ncolumns;
+        w[i].from = start + (end - start) / jobs * i;
+        w[i].to = i == jobs - 1 ? end : start + (end - start) / jobs * (i + 1);
+    }
+    run_workers(w, jobs, scan_chunk);
+
+    // rows start after the first row separator outside quotes in each part
+    bound[0] = start;
+    parity = 0;
+    for (i = 0; i < jobs; ++i)
+        if ( w[i].started )
+            pthread_join(w[i].thread, NULL);
+    for (i = 1, n = 1; i < jobs; ++i) {
+        parity ^= w[i-1].quotes & 1;
+        if ( w[i].eol[parity] != CSV_NONE )
+            bound[n++] = w[i].eol[parity] + 1;
+    }
+    bound[n] = end;
+
+    for (i = 0; i < n; ++i) {
+        w[i].in.pos = bound[i];
+        w[i].in.len = bound[i+1];
+    }
+    run_workers(w, n, parse_chunk);
+
+    for (i = 0; i < n; ++i) {
+        if ( w[i].started )
+            pthread_join(w[i].thread, NULL);
+        w[i].started = 0;
+        if ( !failed && i < n - 1 && (w[i].sep < 0 || !is_rs(w[i].sep, ctx)) ) {
+            failed = 1;
+            in->pos = bound[i];
+            row += append_rows(columns, ncolumns, row, 0, ctx);
+        }
+        for (r = 0, f = (CSV_field *) w[i].fields.data; !failed && r < w[i].rows; ++r, ++row)
+            for (k = 0; k < ncolumns; ++k, ++f)
+                array_insert(columns[k], row, w[i].in.arena.data + f->off);
+        free_worker(&w[i]);
+    }
+    if ( !failed )
+        in->pos = end;
+
+    xfree(bound);
+    xfree(w);
+    return row;
+}
+
+/*
+ *  Bulk mode. Reads rows until eof, or until count rows have been read if
+ *  count is greater than 0, and appends the nth selected field of each row
+ *  to columns[n]. Rows with fewer fields get empty strings, so all the
+ *  arrays stay the same length. Files mapped in memory are parsed by up to
+ *  jobs threads when all of the rows are wanted.
+ *
+ *  returns the number of rows read
+ */
+intmax_t
+read_into_columns(ARRAY **columns, int ncolumns, intmax_t count, int jobs, CSV_context *ctx) {
+
+    CSV_buffer *in = ctx->in;
+    size_t left = in->len - in->pos;
+
+    if ( jobs > 1 && count == 0 && in->mapped && ctx->npreds == 0 && ctx->q != ctx->fs
+         && ctx->q != (ctx->rs == -1 ? '\n' : ctx->rs) && left / CSV_CHUNK_MIN > 1 ) {
+        if ( (size_t) jobs > left / CSV_CHUNK_MIN )
+            jobs = left / CSV_CHUNK_MIN;
+        return append_rows_parallel(columns, ncolumns, jobs, ctx);
+    }
+    return append_rows(columns, ncolumns, 0, count, ctx);
+}
+
+/*
+ *  Copies ctx to to, with copies of its own of the -f bitmap, the widths
+ *  and the predicates, which otherwise only last until the next call.
+ */
+static void
+copy_context(CSV_context *to, CSV_context *ctx)
+{
+    int i;
+
+    *to = *ctx;
+    if ( ctx->cut ) {
+        // cut has cut_len / 8 bytes; never ask xmalloc for none
+        to->cut = xmalloc(ctx->cut_len / 8 + 1);
+        memcpy(to->cut, ctx->cut, ctx->cut_len / 8);
+    }
+    if ( ctx->widths ) {
+        to->widths = xmalloc(ctx->nwidths * sizeof(int));
+        memcpy(to->widths, ctx->widths, ctx->nwidths * sizeof(int));
+    }
+    if ( ctx->npreds ) {
+        to->preds = xmalloc(ctx->npreds * sizeof(CSV_pred));
+        for (i = 0; i < ctx->npreds; ++i) {
+            to->preds[i] = ctx->preds[i];
+            to->preds[i].str = savestring(ctx->preds[i].str);
+        }
+        to->pcut = xmalloc(ctx->plast / 8 + 1);
+        memcpy(to->pcut, ctx->pcut, ctx->plast / 8 + 1);
+    }
+    else
+        to->preds = NULL, to->pcut = NULL;
+}
+
+/*
+ *  Frees what copy_context copied.
+ */
+static void
+free_context(CSV_context *ctx)
+{
+    int i;
+
+    for (i = 0; i < ctx->npreds; ++i)
+        xfree(ctx->preds[i].str);
+    xfree(ctx->preds);
+    xfree(ctx->pcut);
+    xfree(ctx->cut);
+    xfree(ctx->widths);
+}
+
+/*
+ *  Sets columns[n] to the indexed array named by the nth word of names,
+ *  emptied, making it if needed.
+ *
+ *  returns 0 if a name is not usable
+ */
+static int
+bulk_columns(WORD_LIST *names, ARRAY **columns)
+{
+    SHELL_VAR *array;
+    int i;
+
+    for (i = 0; names; names = names->next, ++i) {
+        if ( legal_identifier(names->word->word) == 0 ) {
+            sh_invalidid(names->word->word);
+            return 0;
+        }
+        array = find_or_make_array_variable(names->word->word, 1);
+        if ( array == 0 || assoc_p(array) ) {
+            if ( array )
+                builtin_error("%s: cannot use associative array in bulk mode", names->word->word);
+            return 0;
+        }
+        VUNSETATTR(array, att_invisible);
+        array_flush(array_cell(array));
+        columns[i] = array_cell(array);
+    }
+    return 1;
+}
+
+/*
+ *  Bulk mode with -h. The first of names is an indexed array holding the
+ *  header, which is read from the input first if it is empty, like the
+ *  header of -a. Every other name is given the column whose header field
+ *  is that name: the -f projection is set to those columns, and *ordered
+ *  to the other names in the order of their columns, to be freed with
+ *  xfree. The header is only read once, however many calls use it.
+ *
+ *  returns the number of names in *ordered, or -1 on error
+ */
+static int
+header_columns(WORD_LIST *names, WORD_LIST **ordered, CSV_context *ctx)
+{
+    SHELL_VAR *header;
+    ARRAY *a;
+    ARRAY_ELEMENT *ae;
+    WORD_LIST *w, *list;
+    WORD_DESC *word;
+    int *cols, n, i, j, col, npreds, ret;
+
+    if ( legal_identifier(names->word->word) == 0 ) {
+        sh_invalidid(names->word->word);
+        return -1;
+    }
+    header = find_or_make_array_variable(names->word->word, 1);
+    if ( header == 0 || assoc_p(header) ) {
+        if ( header )
+            builtin_error("%s: not an indexed array", names->word->word);
+        return -1;
+    }
+    VUNSETATTR(header, att_invisible);
+    if ( array_empty(array_cell(header)) ) {
+        // the header row is not filtered
+        npreds = ctx->npreds;
+        ctx->npreds = 0;
+        ret = read_into_array(header, NULL, ctx);
+        ctx->npreds = npreds;
+        if ( ret != EXECUTION_SUCCESS )
+            return -1;
+    }
+
+    a = array_cell(header);
+    for (n = 0, w = names->next; w; w = w->next)
+        ++n;
+    cols = xmalloc(n * sizeof(int));
+    list = xmalloc(n * sizeof(WORD_LIST));
+    for (i = 0, w = names->next; w; w = w->next, ++i) {
+        col = -1;
+        for (ae = element_forw(a->head); ae != a->head; ae = element_forw(ae)) {
+            if ( STREQ(element_value(ae), w->word->word) ) {
+                col = element_index(ae) <= CSV_MAX_FIELD ? element_index(ae) : -1;
+                break;
+            }
+        }
+        if ( col < 0 ) {
+            builtin_error("%s: not in the header", w->word->word);
+            goto fail;
+        }
+        // keep the names sorted by column, as the fields come
+        word = w->word;
+        for (j = i; j > 0 && cols[j-1] >= col; --j) {
+            if ( cols[j-1] == col ) {
+                builtin_error("%s: given twice", word->word);
+                goto fail;
+            }
+            cols[j] = cols[j-1];
+            list[j].word = list[j-1].word;
+        }
+        cols[j] = col;
+        list[j].word = word;
+    }
+    for (i = 0; i < n; ++i)
+        list[i].next = i + 1 < n ? &list[i+1] : NULL;
+    select_fields(cols, n, ctx);
+    xfree(cols);
+    *ordered = list;
+    return n;
+
+fail:
+    xfree(cols);
+    xfree(list);
+    return -1;
+}
+
+/*
+ *  Batches, with -C. Like mapfile -C, the rows are read into the arrays
+ *  named by names quantum at a time, and after each batch callback is run
+ *  with the number of the first row of the batch, counting from 0, and
+ *  the number of rows in it as arguments. The arrays only ever hold one
+ *  batch, and are left empty. The callback can run anything, csv on the
+ *  same fd included, so the options are copied first, the arrays looked
+ *  up again for every batch, and the reader set up again after each
+ *  callback; the read-ahead buffer of the fd carries over all the same.
+ *
+ *  returns the number of rows read, or -1 if a name is not usable
+ */
+static intmax_t
+read_batches(WORD_LIST *names, int ncolumns, char *callback, intmax_t quantum,
+             intmax_t count, CSV_context *ctx)
+{
+    CSV_context own;
+    ARRAY **columns = xmalloc(ncolumns * sizeof(ARRAY *));
+    intmax_t rows = 0, want, n;
+    char *cmd;
+
+    copy_context(&own, ctx);
+    for (;;) {
+        if ( !bulk_columns(names, columns) ) {
+            rows = -1;
+            break;
+        }
+        want = count > 0 && count - rows < quantum ? count - rows : quantum;
+        if ( want == 0 )
+            break;
+        init_reader(&own);
+        n = append_rows(columns, ncolumns, 0, want, &own);
+        sync_reader(&own);
+        if ( n == 0 )
+            break;
+
+        cmd = xmalloc(strlen(callback) + 2 * INT_STRLEN_BOUND(intmax_t) + 3);
+        sprintf(cmd, "%s %jd %jd", callback, rows, n);
+        rows += n;
+        evalstring(cmd, NULL, SEVAL_NOHIST);    // frees cmd
+    }
+    free_context(&own);
+    xfree(columns);
+    return rows;
+}
+
+/*
+ *  Moves the input to the byte at off of the file.
+ */
+static void
+set_offset(CSV_buffer *in, off_t off)
+{
+    if ( in->mapped )
+        in->pos = (size_t) off < in->len ? off : in->len;
+    else {
+        lseek(in->fd, off, SEEK_SET);
+        in->pos = in->len = 0;
+    }
+}
+
+/*
+ *  returns the offset in the file of the next byte to parse
+ */
+static off_t
+get_offset(CSV_buffer *in)
+{
+    if ( in->mapped )
+        return in->pos;
+    return lseek(in->fd, 0, SEEK_CUR) - (off_t) (in->len - in->pos);
+}
+
+/*
+ *  Sidecar files start with a magic string, followed by varints: file size,
+ *  mtime, row separator + 1, quote character, rows, number of offsets, and
+ *  the offsets, each as the difference to the one before.
+ */
+static const char index_magic[8] = "CSVIDX1\n";
+
+static size_t
+put_varint(unsigned char *p, uintmax_t v)
+{
+    size_t n = 0;
+
+    while ( v >= 0x80 ) {
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+static int
+get_varint(unsigned char **p, unsigned char *end, uintmax_t *v)
+{
+    int shift = 0;
+
+    *v = 0;
+    while ( *p < end && shift < 64 ) {
+        *v |= (uintmax_t) (**p & 0x7f) << shift;
+        if ( (*(*p)++ & 0x80) == 0 )
+            return 1;
+        shift += 7;
+    }
+    return 0;
+}
+
+/*
+ *  Writes idx to its sidecar file, through a temporary file that is then
+ *  renamed, so that other readers never see half of it.
+ *
+ *  returns 0 and sets errno if it could not be written
+ */
+static int
+save_index(CSV_index *idx)
+{
+    unsigned char *data, *p;
+    char *tmp;
+    size_t i;
+    int fd, ok, e;
+
+    p = data = xmalloc(sizeof(index_magic) + (idx->n + 7) * 10);
+    memcpy(p, index_magic, sizeof(index_magic));
+    p += sizeof(index_magic);
+    p += put_varint(p, idx->size);
+    p += put_varint(p, idx->mtime);
+    p += put_varint(p, idx->rs + 1);
+    p += put_varint(p, idx->q);
+    p += put_varint(p, idx->rows);
+    p += put_varint(p, idx->n);
+    for (i = 0; i < idx->n; ++i)
+        p += put_varint(p, idx->offsets[i] - (i ? idx->offsets[i-1] : 0));
+
+    tmp = xmalloc(strlen(idx->path) + 8);
+    sprintf(tmp, "%s.XXXXXX", idx->path);
+    ok = (fd = mkstemp(tmp)) >= 0;
+    if ( ok ) {
+        fchmod(fd, 0644);
+        ok = write(fd, data, p - data) == p - data;
+        ok = close(fd) == 0 && ok && rename(tmp, idx->path) == 0;
+        e = errno;
+        if ( !ok )
+            unlink(tmp);
+        errno = e;
+    }
+    xfree(tmp);
+    xfree(data);
+    return ok;
+}
+
+/*
+ *  Reads the index in path, if it was made for a file like st with the row
+ *  separator and quote character of ctx.
+ *
+ *  returns NULL if there is no such index
+ */
+static CSV_index *
+load_index(const char *path, struct stat *st, CSV_context *ctx)
+{
+    CSV_index *idx = NULL;
+    struct stat ist;
+    unsigned char *data = NULL, *p, *end;
+    uintmax_t size, mtime, rs, q, rows, n, delta, off = 0;
+    size_t i;
+    int fd;
+
+    if ( (fd = open(path, O_RDONLY)) < 0 )
+        return NULL;
+    if ( fstat(fd, &ist) == 0 && ist.st_size > (off_t) sizeof(index_magic) ) {
+        data = xmalloc(ist.st_size);
+        if ( read(fd, data, ist.st_size) != ist.st_size ) {
+            xfree(data);
+            data = NULL;
+        }
+    }
+    close(fd);
+    if ( data == NULL )
+        return NULL;
+
+    p = data + sizeof(index_magic);
+    end = data + ist.st_size;
+    if ( memcmp(data, index_magic, sizeof(index_magic)) != 0
+         || !get_varint(&p, end, &size) || size != (uintmax_t) st->st_size
+         || !get_varint(&p, end, &mtime) || mtime != (uintmax_t) st->st_mtime
+         || !get_varint(&p, end, &rs) || rs != (uintmax_t) (ctx->rs + 1)
+         || !get_varint(&p, end, &q) || q != (uintmax_t) ctx->q
+         || !get_varint(&p, end, &rows) || !get_varint(&p, end, &n)
+         || n != rows / CSV_INDEX_STEP + (rows % CSV_INDEX_STEP != 0)
+         || n > (uintmax_t) (end - p) ) {
+        xfree(data);
+        return NULL;
+    }
+
+    idx = xmalloc(sizeof(CSV_index));
+    idx->path = savestring(path);
+    idx->size = st->st_size;
+    idx->mtime = st->st_mtime;
+    idx->rs = ctx->rs;
+    idx->q = ctx->q;
+    idx->rows = rows;
+    idx->n = n;
+    idx->offsets = xmalloc((n + 1) * sizeof(off_t));
+    for (i = 0; i < n; ++i) {
+        if ( !get_varint(&p, end, &delta) || (off += delta) > size ) {
+            free_index(idx);
+            idx = NULL;
+            break;
+        }
+        idx->offsets[i] = off;
+    }
+    xfree(data);
+    return idx;
+}
+
+/*
+ *  Makes an index of the file ctx reads from in one pass, skipping over the
+ *  rows with the same quote handling as the parser.
+ */
+static CSV_index *
+build_index(const char *path, struct stat *st, CSV_context *ctx)
+{
+    CSV_index *idx = xmalloc(sizeof(CSV_index));
+    size_t size = 0;
+
+    idx->path = savestring(path);
+    idx->size = st->st_size;
+    idx->mtime = st->st_mtime;
+    idx->rs = ctx->rs;
+    idx->q = ctx->q;
+    idx->rows = 0;
+    idx->n = 0;
+    idx->offsets = NULL;
+
+    set_offset(ctx->in, 0);
+    while ( fill_buffer(ctx->in) > 0 ) {
+        if ( idx->rows % CSV_INDEX_STEP == 0 ) {
+            if ( idx->n == size ) {
+                size = size ? 2 * size : 64;
+                idx->offsets = xrealloc(idx->offsets, size * sizeof(off_t));
+            }
+            idx->offsets[idx->n++] = get_offset(ctx->in);
+        }
+        skip_csv(ctx, 1);
+        idx->rows++;
+    }
+    return idx;
+}
+
+/*
+ *  returns the index in path for the file ctx reads from, making it and
+ *  saving it first if it is missing or out of date, or NULL if ctx->fd is
+ *  not a regular file
+ */
+static CSV_index *
+get_index(const char *path, CSV_context *ctx)
+{
+    CSV_buffer *in = ctx->in;
+    CSV_index *idx = in->index;
+    struct stat st;
+
+    if ( fstat(in->fd, &st) < 0 || !S_ISREG(st.st_mode) ) {
+        builtin_error("%d: not a regular file", in->fd);
+        return NULL;
+    }
+    if ( !in->seekable ) {
+        builtin_error("%d: cannot seek", in->fd);
+        return NULL;
+    }
+    if ( idx && strcmp(idx->path, path) == 0 && idx->size == st.st_size && idx->mtime == st.st_mtime
+         && idx->rs == ctx->rs && idx->q == ctx->q )
+        return idx;
+
+    free_index(idx);
+    if ( (idx = load_index(path, &st, ctx)) == NULL ) {
+        idx = build_index(path, &st, ctx);
+        if ( !save_index(idx) )
+            builtin_warning("%s: cannot save index: %s", path, strerror(errno));
+    }
+    return in->index = idx;
+}
+
+/*
+ *  Moves the input to the start of row, counting from the start of the
+ *  file, using the index in path if it is not NULL and skipping rows from
+ *  the start otherwise.
+ *
+ *  returns 0 if there is no such row, or the fd cannot seek
+ */
+int
+seek_row(uintmax_t row, const char *path, CSV_context *ctx)
+{
+    CSV_index *idx = NULL;
+    uintmax_t n = row;
+
+    if ( !ctx->in->seekable ) {
+        builtin_error("%d: cannot seek", ctx->fd);
+        return 0;
+    }
+    if ( path ) {
+        if ( (idx = get_index(path, ctx)) == NULL )
+            return 0;
+        if ( row >= idx->rows ) {
+            set_offset(ctx->in, idx->size);
+            return 0;
+        }
+        set_offset(ctx->in, idx->offsets[row / CSV_INDEX_STEP]);
+        n = row % CSV_INDEX_STEP;
+    }
+    else
+        set_offset(ctx->in, 0);
+
+    for (; n > 0; --n)
+        if ( fill_buffer(ctx->in) == 0 || skip_csv(ctx, 1) == -1 )
+            return 0;
+    return fill_buffer(ctx->in) > 0;
+}
+
+/*
+ *  Prepared readers, made with -P and used with -H. A handle keeps the
+ *  options of the csv call that made it, with its own copies of the -f
+ *  bitmap and the predicates, and the NAMEs, already checked, so reading a
+ *  row with it skips option parsing and name validation.
+ */
+typedef struct CSV_handle {
+    char *name;
+    CSV_context ctx;
+    int use_array;
+    WORD_LIST *words;           // the NAMEs
+    struct CSV_handle *next;
+} CSV_handle;
+
+static CSV_handle *handles = NULL;
+
+static void
+free_handle(CSV_handle *h)
+{
+    free_context(&h->ctx);
+    dispose_words(h->words);
+    xfree(h->name);
+    xfree(h);
+}
+
+static CSV_handle *
+find_handle(const char *name)
+{
+    CSV_handle *h;
+
+    for (h = handles; h; h = h->next)
+        if ( STREQ(h->name, name) )
+            return h;
+    return NULL;
+}
+
+/*
+ *  Makes the handle name, reading with the options in ctx into the
+ *  variables in words, replacing any handle of that name. Without words,
+ *  the handle is just removed.
+ */
+static void
+save_handle(const char *name, CSV_context *ctx, int use_array, WORD_LIST *words)
+{
+    CSV_handle *h, **hp;
+
+    for (hp = &handles; (h = *hp); hp = &h->next) {
+        if ( STREQ(h->name, name) ) {
+            *hp = h->next;
+            free_handle(h);
+            break;
+        }
+    }
+    if ( words == NULL )
+        return;
+
+    h = xmalloc(sizeof(CSV_handle));
+    h->name = savestring(name);
+    copy_context(&h->ctx, ctx);
+    h->use_array = use_array;
+    h->words = copy_word_list(words);
+    h->next = handles;
+    handles = h;
+}
+
+/*
+ *  Tables, loaded with -L and used with -T. A table holds the rows read,
+ *  with the values of all the cells one after another, each NUL-terminated,
+ *  in one block of text, and for each column the offset of its cell in
+ *  every row in another block, so any cell is found with two lookups
+ *  instead of a walk down a bash array. Rows keep the number of fields they
+ *  had, and cells past the end of a row are empty, with offset 0. A table
+ *  read from a cache made with -X is used in place, in the mapped file.
+ */
+typedef struct CSV_table {
+    char *name;
+    char *text;             // cell values; offset 0 is an empty string
+    size_t text_used, text_size;
+    size_t **cols;          // offset in text of the cell of each row, for
+                            // each column
+    int ncols, cols_size;   // fields in the longest row
+    unsigned int *lens;     // number of fields in each row
+    size_t nrows, rows_size;
+    void *map;              // the cache the table is in, or NULL
+    size_t map_len;
+    struct CSV_table *next;
+} CSV_table;
+
+static CSV_table *tables = NULL;
+
+static void
+free_table(CSV_table *t)
+{
+    int c;
+
+    if ( t->map )
+        munmap(t->map, t->map_len);
+    else {
+        for (c = 0; c < t->ncols; ++c)
+            xfree(t->cols[c]);
+        xfree(t->text);
+        xfree(t->lens);
+    }
+    xfree(t->cols);
+    xfree(t->name);
+    xfree(t);
+}
+
+static CSV_table *
+find_table(const char *name)
+{
+    CSV_table *t;
+
+    for (t = tables; t; t = t->next)
+        if ( STREQ(t->name, name) )
+            return t;
+    return NULL;
+}
+
+/*
+ *  Removes the table name, if there is one.
+ */
+static void
+drop_table(const char *name)
+{
+    CSV_table *t, **tp;
+
+    for (tp = &tables; (t = *tp); tp = &t->next) {
+        if ( STREQ(t->name, name) ) {
+            *tp = t->next;
+            free_table(t);
+            return;
+        }
+    }
+}
+
+/*
+ *  Adds t to the tables as name, replacing any table of that name.
+ */
+static void
+add_table(CSV_table *t, const char *name)
+{
+    drop_table(name);
+    t->name = savestring(name);
+    t->next = tables;
+    tables = t;
+}
+
+/*
+ *  Reads the remaining rows, or at most count rows if count is greater than
+ *  0, into a new table. Only the fields selected with -f are kept.
+ */
+static CSV_table *
+read_table(intmax_t count, CSV_context *ctx)
+{
+    CSV_table *t = xmalloc(sizeof(CSV_table));
+    CSV_field field;
+    size_t len, r;
+    int c, k, sep;
+
+    t->name = NULL;
+    t->text_size = 4096;
+    t->text = xmalloc(t->text_size);
+    t->text[0] = '\0';
+    t->text_used = 1;
+    t->rows_size = 1024;
+    t->lens = xmalloc(t->rows_size * sizeof(unsigned int));
+    t->nrows = 0;
+    t->cols_size = 16;
+    t->cols = xmalloc(t->cols_size * sizeof(size_t *));
+    t->ncols = 0;
+    t->map = NULL;
+    t->map_len = 0;
+
+    while ( (count <= 0 || t->nrows < (size_t) count) && start_row(ctx) ) {
+        if ( t->nrows == t->rows_size ) {
+            t->rows_size *= 2;
+            t->lens = xrealloc(t->lens, t->rows_size * sizeof(unsigned int));
+            for (c = 0; c < t->ncols; ++c)
+                t->cols[c] = xrealloc(t->cols[c], t->rows_size * sizeof(size_t));
+        }
+        r = t->nrows++;
+        k = 0;
+        do {
+            if ( ctx->col >= ctx->last ) {
+                sep = skip_csv_row(ctx);
+                break;
+            }
+            sep = next_field(&field, ctx);
+            if ( skip_field(ctx->col, ctx) )
+                continue;
+            if ( k == t->ncols ) {
+                // a new column, empty in the rows before
+                if ( t->ncols == t->cols_size ) {
+                    t->cols_size *= 2;
+                    t->cols = xrealloc(t->cols, t->cols_size * sizeof(size_t *));
+                }
+                t->cols[k] = xmalloc(t->rows_size * sizeof(size_t));
+                memset(t->cols[k], 0, r * sizeof(size_t));
+                t->ncols++;
+            }
+            if ( field.len == 0 )
+                t->cols[k][r] = 0;
+            else {
+                len = field.len + 1;
+                if ( t->text_used + len > t->text_size ) {
+                    while ( t->text_used + len > t->text_size )
+                        t->text_size *= 2;
+                    t->text = xrealloc(t->text, t->text_size);
+                }
+                memcpy(t->text + t->text_used, field_value(ctx, field), len);
+                t->cols[k][r] = t->text_used;
+                t->text_used += len;
+            }
+            drop_field(&field, ctx);
+            k++;
+        } while ( sep >= 0 && !is_rs(sep, ctx) );
+        t->lens[r] = k;
+        for (c = k; c < t->ncols; ++c)
+            t->cols[c][r] = 0;
+        if ( sep < 0 )
+            break;
+    }
+
+    // give back what the doubling left unused
+    t->text = xrealloc(t->text, t->text_size = t->text_used);
+    t->rows_size = t->nrows ? t->nrows : 1;
+    t->lens = xrealloc(t->lens, t->rows_size * sizeof(unsigned int));
+    for (c = 0; c < t->ncols; ++c)
+        t->cols[c] = xrealloc(t->cols[c], t->rows_size * sizeof(size_t));
+    return t;
+}
+
+/*
+ *  Reads the remaining rows, or at most count rows if count is greater than
+ *  0, into the table name, replacing any table of that name.
+ *
+ *  returns the number of rows read
+ */
+static intmax_t
+load_table(const char *name, intmax_t count, CSV_context *ctx)
+{
+    CSV_table *t = read_table(count, ctx);
+
+    add_table(t, name);
+    return t->nrows;
+}
+
+/*
+ *  returns the value of the cell at row, col, or NULL if there is no such
+ *  row
+ */
+static inline char *
+table_cell(CSV_table *t, size_t row, size_t col)
+{
+    if ( row >= t->nrows )
+        return NULL;
+    if ( col >= t->lens[row] )
+        return t->text;
+    return t->text + t->cols[col][row];
+}
+
+/*
+ *  Parses the number in word into *n, printing an error if it is not a
+ *  number of at least 0.
+ */
+static int
+table_index(char *word, intmax_t *n)
+{
+    if ( legal_number(word, n) == 0 || *n < 0 ) {
+        builtin_error("%s: invalid number", word);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ *  Runs the table command in list on t:
+ *
+ *    rows NAME                  set NAME to the number of rows
+ *    cols NAME                  set NAME to the number of fields in the
+ *                               longest row
+ *    cell ROW COL NAME          set NAME to the cell at ROW, COL
+ *    row ROW NAME ...           set the NAMEs to the cells of ROW, like
+ *                               reading a row, or with -a the array NAME
+ *    column COL NAME [FROM [COUNT]]
+ *                               set the indexed array NAME to the cells of
+ *                               column COL, from row FROM on, COUNT at most
+ *
+ *  Rows and columns are counted from 0. cell, row and column fail if there
+ *  is no such row.
+ */
+static int
+table_command(CSV_table *t, WORD_LIST *list, int use_array)
+{
+    SHELL_VAR *var;
+    ARRAY *a;
+    char *cmd, *value;
+    char buf[INT_STRLEN_BOUND(uintmax_t) + 1];
+    intmax_t row, col, from = 0, count = -1, i;
+    WORD_LIST *l;
+    int n;
+
+    for (n = 0, l = list; l; l = l->next)
+        n++;
+    cmd = n ? list->word->word : "";
+    if ( (STREQ(cmd, "rows") || STREQ(cmd, "cols")) && n == 2 ) {
+        bind_read_variable(list->next->word->word,
+                           fmtumax(cmd[0] == 'r' ? t->nrows : t->ncols, 10, buf, sizeof(buf), 0));
+        return EXECUTION_SUCCESS;
+    }
+    if ( STREQ(cmd, "cell") && n == 4 ) {
+        list = list->next;
+        if ( !table_index(list->word->word, &row) || !table_index(list->next->word->word, &col) )
+            return EXECUTION_FAILURE;
+        if ( (value = table_cell(t, row, col)) == NULL )
+            return EXECUTION_FAILURE;
+        bind_read_variable(list->next->next->word->word, value);
+        return EXECUTION_SUCCESS;
+    }
+    if ( STREQ(cmd, "row") && n >= 3 ) {
+        list = list->next;
+        if ( !table_index(list->word->word, &row) )
+            return EXECUTION_FAILURE;
+        if ( (size_t) row >= t->nrows )
+            return EXECUTION_FAILURE;
+        list = list->next;
+        if ( use_array ) {
+            if ( legal_identifier(list->word->word) == 0 ) {
+                sh_invalidid(list->word->word);
+                return EXECUTION_FAILURE;
+            }
+            var = find_or_make_array_variable(list->word->word, 1);
+            if ( var == 0 || !array_p(var) ) {
+                if ( var )
+                    builtin_error("%s: not an indexed array", list->word->word);
+                return EXECUTION_FAILURE;
+            }
+            VUNSETATTR(var, att_invisible);
+            a = array_cell(var);
+            array_flush(a);
+            for (col = 0; col < t->lens[row]; ++col)
+                array_insert(a, col, table_cell(t, row, col));
+            return EXECUTION_SUCCESS;
+        }
+        for (col = 0; list; list = list->next, ++col)
+            bind_read_variable(list->word->word, table_cell(t, row, col));
+        return EXECUTION_SUCCESS;
+    }
+    if ( STREQ(cmd, "column") && n >= 3 && n <= 5 ) {
+        list = list->next;
+        if ( !table_index(list->word->word, &col) )
+            return EXECUTION_FAILURE;
+        l = list->next;
+        if ( l->next && !table_index(l->next->word->word, &from) )
+            return EXECUTION_FAILURE;
+        if ( l->next && l->next->next && !table_index(l->next->next->word->word, &count) )
+            return EXECUTION_FAILURE;
+        if ( legal_identifier(l->word->word) == 0 ) {
+            sh_invalidid(l->word->word);
+            return EXECUTION_FAILURE;
+        }
+        var = find_or_make_array_variable(l->word->word, 1);
+        if ( var == 0 || !array_p(var) ) {
+            if ( var )
+                builtin_error("%s: not an indexed array", l->word->word);
+            return EXECUTION_FAILURE;
+        }
+        VUNSETATTR(var, att_invisible);
+        a = array_cell(var);
+        array_flush(a);
+        if ( (size_t) from >= t->nrows )
+            return EXECUTION_FAILURE;
+        for (i = 0; (count < 0 || i < count) && (size_t) (from + i) < t->nrows; ++i)
+            array_insert(a, i, table_cell(t, from + i, col));
+        return EXECUTION_SUCCESS;
+    }
+    builtin_usage();
+    return EX_USAGE;
+}
+
+/*
+ *  Caches, with -X. A cache file holds a table read from a file, as it is
+ *  in memory: a header, the widths given with -W, the number of fields in
+ *  each row, the offsets of the cells of each column and the text, all in
+ *  the byte order and size_t of the machine that wrote it. Like an index,
+ *  it is tagged with the size and mtime of the file and the separators it
+ *  was read with, and made again when any of these do not match. A cache
+ *  that matches is mapped and used as it is, without parsing anything.
+ */
+static const char cache_magic[8] = "CSVCOL1\n";
+
+typedef struct CSV_cachehdr {
+    char magic[8];
+    uint64_t order;             // CSV_CACHE_ORDER
+    uint64_t size, mtime;       // of the file read
+    uint64_t rs, fs, q;         // rs + 1
+    uint64_t nwidths;
+    uint64_t nrows, ncols;
+    uint64_t text_len;
+} CSV_cachehdr;
+
+#define CACHE_ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+/*
+ *  returns 1 if all len bytes at data were written to fd
+ */
+static int
+write_all(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    ssize_t n;
+
+    while ( len > 0 ) {
+        if ( (n = write(fd, p, len)) < 0 ) {
+            if ( errno == EINTR )
+                continue;
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/*
+ *  Writes the table t, read from a file like st with ctx, to a cache in
+ *  path, through a temporary file that is then renamed, like an index.
+ *
+ *  returns 0 and sets errno if it could not be written
+ */
+static int
+save_cache(CSV_table *t, const char *path, struct stat *st, CSV_context *ctx)
+{
+    CSV_cachehdr h;
+    uint64_t w;
+    static const char pad[8];
+    char *tmp;
+    size_t len;
+    int fd, ok, e, c;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, cache_magic, sizeof(cache_magic));
+    h.order = CSV_CACHE_ORDER;
+    h.size = st->st_size;
+    h.mtime = st->st_mtime;
+    h.rs = ctx->rs + 1;
+    h.fs = ctx->fs;
+    h.q = ctx->q;
+    h.nwidths = ctx->widths ? ctx->nwidths : 0;
+    h.nrows = t->nrows;
+    h.ncols = t->ncols;
+    h.text_len = t->text_used;
+
+    tmp = xmalloc(strlen(path) + 8);
+    sprintf(tmp, "%s.XXXXXX", path);
+    ok = (fd = mkstemp(tmp)) >= 0;
+    if ( ok ) {
+        fchmod(fd, 0644);
+        ok = write_all(fd, &h, sizeof(h));
+        for (c = 0; ok && c < (int) h.nwidths; ++c) {
+            w = ctx->widths[c];
+            ok = write_all(fd, &w, sizeof(w));
+        }
+        len = t->nrows * sizeof(unsigned int);
+        ok = ok && write_all(fd, t->lens, len) && write_all(fd, pad, CACHE_ALIGN(len) - len);
+        for (c = 0; ok && c < t->ncols; ++c)
+            ok = write_all(fd, t->cols[c], t->nrows * sizeof(size_t));
+        ok = ok && write_all(fd, t->text, t->text_used);
+        ok = close(fd) == 0 && ok && rename(tmp, path) == 0;
+        e = errno;
+        if ( !ok )
+            unlink(tmp);
+        errno = e;
+    }
+    xfree(tmp);
+    return ok;
+}
+
+/*
+ *  Maps the cache in path, if it was made for a file like st read with
+ *  the separators and widths of ctx, and checks that it holds a table
+ *  that can be used safely.
+ *
+ *  returns the table, or NULL if there is no such cache
+ */
+static CSV_table *
+load_cache(const char *path, struct stat *st, CSV_context *ctx)
+{
+    CSV_table *t;
+    CSV_cachehdr *h;
+    struct stat cst;
+    uint64_t *widths;
+    unsigned int *lens;
+    size_t *col, len, r;
+    char *map, *text;
+    int fd, c, ok;
+
+    if ( (fd = open(path, O_RDONLY)) < 0 )
+        return NULL;
+    map = MAP_FAILED;
+    if ( fstat(fd, &cst) == 0 && cst.st_size >= (off_t) sizeof(CSV_cachehdr) )
+        map = mmap(NULL, cst.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( map == MAP_FAILED )
+        return NULL;
+
+    h = (CSV_cachehdr *) map;
+    widths = (uint64_t *) (map + sizeof(CSV_cachehdr));
+    ok = memcmp(h->magic, cache_magic, sizeof(cache_magic)) == 0 && h->order == CSV_CACHE_ORDER
+         && h->size == (uint64_t) st->st_size && h->mtime == (uint64_t) st->st_mtime
+         && h->rs == (uint64_t) (ctx->rs + 1) && h->fs == (uint64_t) ctx->fs && h->q == (uint64_t) ctx->q
+         && h->nwidths == (uint64_t) (ctx->widths ? ctx->nwidths : 0)
+         && h->nrows < (uint64_t) cst.st_size && h->ncols <= (uint64_t) CSV_MAX_FIELD + 1
+         && (h->ncols == 0 || h->nrows <= (uint64_t) cst.st_size / h->ncols / sizeof(size_t))
+         && h->text_len > 0 && h->text_len < (uint64_t) cst.st_size;
+    // the header fields are bounded above, so this cannot overflow; nothing
+    // after the header is looked at until the file is known to hold it all
+    if ( ok ) {
+        len = sizeof(CSV_cachehdr) + h->nwidths * sizeof(uint64_t)
+              + CACHE_ALIGN(h->nrows * sizeof(unsigned int))
+              + h->ncols * h->nrows * sizeof(size_t) + h->text_len;
+        ok = len == (size_t) cst.st_size;
+    }
+    for (c = 0; ok && c < (int) h->nwidths; ++c)
+        ok = widths[c] == (uint64_t) ctx->widths[c];
+    if ( !ok ) {
+        munmap(map, cst.st_size);
+        return NULL;
+    }
+
+    // every cell must be a NUL-terminated string in the text
+    lens = (unsigned int *) (widths + h->nwidths);
+    col = (size_t *) ((char *) lens + CACHE_ALIGN(h->nrows * sizeof(unsigned int)));
+    text = (char *) (col + h->ncols * h->nrows);
+    ok = text[0] == '\0' && text[h->text_len - 1] == '\0';
+    for (r = 0; ok && r < h->nrows; ++r)
+        ok = lens[r] <= h->ncols;
+    for (r = 0; ok && r < h->ncols * h->nrows; ++r)
+        ok = col[r] < h->text_len;
+    if ( !ok ) {
+        munmap(map, cst.st_size);
+        return NULL;
+    }
+
+    t = xmalloc(sizeof(CSV_table));
+    t->name = NULL;
+    t->text = text;
+    t->text_used = t->text_size = h->text_len;
+    t->ncols = t->cols_size = h->ncols;
+    t->cols = xmalloc((t->ncols ? t->ncols : 1) * sizeof(size_t *));
+    for (c = 0; c < t->ncols; ++c)
+        t->cols[c] = col + c * h->nrows;
+    t->lens = lens;
+    t->nrows = t->rows_size = h->nrows;
+    t->map = map;
+    t->map_len = cst.st_size;
+    return t;
+}
+
+/*
+ *  returns the table of all the rows of the file ctx reads from, from the
+ *  cache in path, reading the file and saving the cache first if it is
+ *  missing or out of date, or NULL if ctx->fd is not a regular file. The
+ *  input is left at the end of the file.
+ */
+static CSV_table *
+get_cache(const char *path, CSV_context *ctx)
+{
+    CSV_context all = *ctx;
+    CSV_table *t;
+    struct stat st;
+
+    if ( fstat(ctx->in->fd, &st) < 0 || !S_ISREG(st.st_mode) ) {
+        builtin_error("%d: not a regular file", ctx->in->fd);
+        return NULL;
+    }
+    if ( !ctx->in->seekable ) {
+        builtin_error("%d: cannot seek", ctx->in->fd);
+        return NULL;
+    }
+    if ( (t = load_cache(path, &st, ctx)) == NULL ) {
+        // the cache has every field, whatever -f selects
+        all.cut = NULL;
+        all.cut_from = all.last = INT_MAX;
+        set_offset(ctx->in, 0);
+        t = read_table(0, &all);
+        if ( !save_cache(t, path, &st, ctx) )
+            builtin_warning("%s: cannot save cache: %s", path, strerror(errno));
+    }
+    set_offset(ctx->in, st.st_size);
+    return t;
+}
+
+/*
+ *  Sets element 0, 1, ... of columns[n] to the nth field selected with -f
+ *  in each row of t, like reading the rows with -b.
+ *
+ *  returns the number of rows
+ */
+static intmax_t
+table_columns(CSV_table *t, ARRAY **columns, int ncolumns, CSV_context *ctx)
+{
+    size_t r, *col;
+    int c, k;
+
+    for (c = k = 0; k < ncolumns; ++c) {
+        // fields past the last one selected are left empty, as by read_row
+        if ( c <= ctx->last && skip_field(c, ctx) )
+            continue;
+        col = c < t->ncols && c <= ctx->last ? t->cols[c] : NULL;
+        for (r = 0; r < t->nrows; ++r)
+            array_insert(columns[k], r, col ? t->text + col[r] : "");
+        k++;
+    }
+    return t->nrows;
+}
+
+/*
+ *  Grouping, with -g and -A. Rows are put in groups by the values of the
+ *  key fields, joined with the field separator, and for each group every
+ *  aggregate is kept up to date as the rows stream by. Groups live in a
+ *  native open addressing hash table; only the results end up in bash.
+ */
+enum { AGG_COUNT, AGG_SUM, AGG_MIN, AGG_MAX, AGG_MEAN };
+
+static const char *agg_names[] = { "count", "sum", "min", "max", "mean", NULL };
+
+typedef struct CSV_aggspec {
+    int op;         // AGG_*
+    int col;        // field aggregated, unused for count
+} CSV_aggspec;
+
+/*
+ *  Running aggregate of the numeric values of one field in one group. Sums
+ *  are kept as integers as long as every value is an integer and they fit.
+ *  The least and greatest integers and other values are kept apart, so an
+ *  integer extreme is given exactly whatever else is seen.
+ */
+typedef struct CSV_acc {
+    intmax_t n;                     // number of numeric values seen
+    intmax_t isum;
+    double sum;
+    int real_sum;                   // 1 once isum is unusable
+    intmax_t imin, imax;            // of the integer values
+    double min, max;                // of the other values
+    int ints, reals;                // 1 once an integer, or other value,
+                                    // is seen
+} CSV_acc;
+
+typedef struct CSV_group {
+    size_t key;     // offset of the key in CSV_groups.text
+    size_t keylen;
+    size_t hash;
+    intmax_t rows;
+} CSV_group;
+
+typedef struct CSV_groups {
+    int nkeys;
+    int *keys;                  // key field numbers, in order
+    int naggs;
+    CSV_aggspec *aggs;
+    CSV_arena text;             // keys, one after another, each field
+                                // preceded by its length as a varint
+    CSV_group *groups;
+    CSV_acc *acc;               // naggs per group
+    size_t ngroups, size;       // groups in use and allocated
+    size_t *table;              // group number + 1, or 0 if the slot is free
+    size_t mask;                // table size - 1
+} CSV_groups;
+
+/*
+ *  Like the -f bitmap, the parsed -g and -A lists are kept until the next
+ *  call.
+ */
+static int *key_storage = NULL;
+static CSV_aggspec *agg_storage = NULL;
+
+/*
+ *  Parses a comma separated list of field numbers into *keys, using and
+ *  replacing *storage, which is kept until the next call.
+ *
+ *  returns the number of fields, or 0 if the list is illegal
+ */
+static int
+parse_fields(char *s, int **keys, int **storage)
+{
+    int n = 0;
+
+    xfree(*storage);
+    *keys = *storage = xmalloc((strlen(s) / 2 + 1) * sizeof(int));
+    for (;;) {
+        if ( ((*keys)[n++] = parse_field_number(&s)) < 0 )
+            break;
+        if ( *s == '\0' )
+            return n;
+        if ( *s++ != ',' )
+            break;
+    }
+    return 0;
+}
+
+/*
+ *  Parses the -g list into g.
+ *
+ *  returns 0 if the list is illegal
+ */
+static int
+parse_keys(char *s, CSV_groups *g)
+{
+    return g->nkeys = parse_fields(s, &g->keys, &key_storage);
+}
+
+/*
+ *  Parses the -A list, aggregates like "count,sum:3,max:3", into g.
+ *
+ *  returns 0 if the list is illegal
+ */
+static int
+parse_aggregates(char *s, CSV_groups *g)
+{
+    CSV_aggspec *aggs;
+    int n = 0, op;
+    size_t len;
+
+    xfree(agg_storage);
+    g->aggs = aggs = agg_storage = xmalloc((strlen(s) / 2 + 1) * sizeof(CSV_aggspec));
+    for (;;) {
+        len = strcspn(s, ":,");
+        for (op = 0; agg_names[op]; ++op)
+            if ( strlen(agg_names[op]) == len && strncmp(s, agg_names[op], len) == 0 )
+                break;
+        if ( agg_names[op] == NULL )
+            break;
+        s += len;
+        aggs[n].op = op;
+        aggs[n].col = -1;
+        if ( op != AGG_COUNT ) {
+            if ( *s++ != ':' || (aggs[n].col = parse_field_number(&s)) < 0 )
+                break;
+        }
+        ++n;
+        if ( *s == '\0' )
+            return g->naggs = n;
+        if ( *s++ != ',' )
+            break;
+    }
+    return 0;
+}
+
+static void init_quoting(CSV_context *);
+
+/*
+ *  returns the group for the key of len bytes, adding it if it is new
+ */
+static size_t
+find_group(CSV_groups *g, const char *key, size_t len)
+{
+    size_t h = 14695981039346656037ULL, i, k, n;
+    CSV_group *grp;
+
+    for (i = 0; i < len; ++i)
+        h = (h ^ (unsigned char) key[i]) * 1099511628211ULL;
+    for (i = h & g->mask; (k = g->table[i]); i = (i + 1) & g->mask) {
+        grp = &g->groups[k - 1];
+        if ( grp->hash == h && grp->keylen == len
+             && memcmp(g->text.data + grp->key, key, len) == 0 )
+            return k - 1;
+    }
+
+    if ( g->ngroups == g->size ) {
+        g->size = g->size ? 2 * g->size : 64;
+        g->groups = xrealloc(g->groups, g->size * sizeof(CSV_group));
+        g->acc = xrealloc(g->acc, g->size * g->naggs * sizeof(CSV_acc));
+    }
+    n = g->ngroups++;
+    grp = &g->groups[n];
+    arena_reserve(&g->text, len);
+    memcpy(g->text.data + g->text.used, key, len);
+    grp->key = g->text.used;
+    grp->keylen = len;
+    g->text.used += len;
+    grp->hash = h;
+    grp->rows = 0;
+    memset(&g->acc[n * g->naggs], 0, g->naggs * sizeof(CSV_acc));
+    g->table[i] = n + 1;
+
+    // keep the table at most half full
+    if ( 2 * g->ngroups > g->mask ) {
+        g->mask = 2 * g->mask + 1;
+        g->table = xrealloc(g->table, (g->mask + 1) * sizeof(size_t));
+        memset(g->table, 0, (g->mask + 1) * sizeof(size_t));
+        for (k = 0; k < g->ngroups; ++k) {
+            for (i = g->groups[k].hash & g->mask; g->table[i]; i = (i + 1) & g->mask)
+                ;
+            g->table[i] = k + 1;
+        }
+    }
+    return n;
+}
+
+/*
+ *  Adds the value of a field to an aggregate. Values that are not numbers,
+ *  empty ones and ones with leading blanks included, are left out.
+ */
+static void
+accumulate(CSV_acc *acc, const char *s, size_t len)
+{
+    char *end;
+    intmax_t i;
+    double d;
+
+    if ( len == 0 || isspace((unsigned char) *s) )
+        return;
+    errno = 0;
+    i = strtoimax(s, &end, 10);
+    if ( end == s + len && errno == 0 ) {
+        if ( !acc->ints || i < acc->imin )
+            acc->imin = i;
+        if ( !acc->ints || i > acc->imax )
+            acc->imax = i;
+        acc->ints = 1;
+        if ( !acc->real_sum && __builtin_add_overflow(acc->isum, i, &acc->isum) )
+            acc->real_sum = 1;
+        d = i;
+    }
+    else {
+        d = strtod(s, &end);
+        if ( end != s + len || end == s )
+            return;
+        if ( !acc->reals || d < acc->min )
+            acc->min = d;
+        if ( !acc->reals || d > acc->max )
+            acc->max = d;
+        acc->reals = 1;
+        acc->real_sum = 1;
+    }
+    acc->n++;
+    acc->sum += d;
+}
+
+/*
+ *  Reads rows until eof, or until count rows have been read if count is
+ *  greater than 0, and aggregates them into g.
+ *
+ *  returns the number of rows read
+ */
+static intmax_t
+aggregate_rows(CSV_groups *g, intmax_t count, CSV_context *ctx)
+{
+    CSV_field *vals, field;
+    CSV_acc *acc;
+    intmax_t rows;
+    size_t grp;
+    size_t keysize = 64, keylen, len;
+    char *key = xmalloc(keysize);
+    int i, sep;
+
+    vals = xmalloc((ctx->last + 1) * sizeof(CSV_field));
+    for (rows = 0; count <= 0 || rows < count; ++rows) {
+        if ( !start_row(ctx) )
+            break;
+
+        // fields not in the row are empty
+        arena_reserve(ctx->arena, 1);
+        ctx->arena->data[ctx->arena->used] = '\0';
+        for (i = 0; i <= ctx->last; ++i) {
+            vals[i].off = ctx->arena->used;
+            vals[i].len = 0;
+        }
+        ctx->arena->used++;
+        do {
+            if ( ctx->col >= ctx->last ) {
+                sep = skip_csv_row(ctx);
+                break;
+            }
+            sep = next_field(&field, ctx);
+            if ( !skip_field(ctx->col, ctx) )
+                vals[ctx->col] = field;
+        } while ( sep >= 0 && !is_rs(sep, ctx) );
+
+        // length-prefixed, so no two lists of fields give the same key
+        for (i = 0, keylen = 0; i < g->nkeys; ++i) {
+            len = vals[g->keys[i]].len;
+            if ( keylen + len + 10 > keysize ) {
+                keysize = 2 * (keylen + len + 10);
+                key = xrealloc(key, keysize);
+            }
+            keylen += put_varint((unsigned char *) key + keylen, len);
+            memcpy(key + keylen, field_value(ctx, vals[g->keys[i]]), len);
+            keylen += len;
+        }
+
+        grp = find_group(g, key, keylen);
+        g->groups[grp].rows++;
+        acc = &g->acc[grp * g->naggs];
+        for (i = 0; i < g->naggs; ++i)
+            if ( g->aggs[i].op != AGG_COUNT )
+                accumulate(&acc[i], field_value(ctx, vals[g->aggs[i].col]), vals[g->aggs[i].col].len);
+
+        if ( sep == -1 ) {
+            ++rows;
+            break;
+        }
+    }
+    xfree(vals);
+    xfree(key);
+    return rows;
+}
+
+/*
+ *  Formats aggregate i of group grp into buf.
+ */
+static char *
+format_aggregate(CSV_groups *g, size_t grp, int i, char *buf, size_t size)
+{
+    CSV_acc *acc = &g->acc[grp * g->naggs + i];
+
+    switch (g->aggs[i].op) {
+        case AGG_COUNT:
+            snprintf(buf, size, "%jd", g->groups[grp].rows);
+            break;
+        case AGG_SUM:
+            if ( acc->real_sum )
+                snprintf(buf, size, "%.15g", acc->sum);
+            else
+                snprintf(buf, size, "%jd", acc->isum);
+            break;
+        case AGG_MIN:
+            if ( acc->n == 0 )
+                buf[0] = '\0';
+            else if ( !acc->reals || acc->ints && (double) acc->imin <= acc->min )
+                snprintf(buf, size, "%jd", acc->imin);
+            else
+                snprintf(buf, size, "%.15g", acc->min);
+            break;
+        case AGG_MAX:
+            if ( acc->n == 0 )
+                buf[0] = '\0';
+            else if ( !acc->reals || acc->ints && (double) acc->imax >= acc->max )
+                snprintf(buf, size, "%jd", acc->imax);
+            else
+                snprintf(buf, size, "%.15g", acc->max);
+            break;
+        case AGG_MEAN:
+            if ( acc->n == 0 )
+                buf[0] = '\0';
+            else
+                snprintf(buf, size, "%.15g", (acc->real_sum ? acc->sum : (double) acc->isum) / acc->n);
+            break;
+    }
+    return buf;
+}
+
+/*
+ *  returns the key of group grp as it is bound: the -g fields separated by
+ *  SEP, each quoted the way print_field would if there are several
+ */
+static char *
+group_key(CSV_groups *g, size_t grp, CSV_context *ctx)
+{
+    unsigned char *p = (unsigned char *) g->text.data + g->groups[grp].key;
+    unsigned char *end = p + g->groups[grp].keylen;
+    uintmax_t len, j;
+    char *s;
+    size_t n = 0;
+    int i;
+
+    // at worst every byte is a doubled quote
+    s = xmalloc(2 * g->groups[grp].keylen + 3 * g->nkeys + 1);
+    for (i = 0; get_varint(&p, end, &len); ++i, p += len) {
+        if ( i > 0 )
+            s[n++] = ctx->fs;
+        if ( g->nkeys == 1 || !ctx->quote_fields || scan_bytes((char *) p, len, ctx->pstop) == len ) {
+            memcpy(s + n, p, len);
+            n += len;
+            continue;
+        }
+        s[n++] = ctx->q;
+        for (j = 0; j < len; ++j) {
+            s[n++] = p[j];
+            if ( p[j] == ctx->q )
+                s[n++] = ctx->q;
+        }
+        s[n++] = ctx->q;
+    }
+    s[n] = '\0';
+    return s;
+}
+
+/*
+ *  Group-by mode. Aggregates the rows, then assigns the results of the nth
+ *  aggregate to the associative array named by the nth word of list, keyed
+ *  by group.
+ *
+ *  returns EXECUTION_SUCCESS if any rows were read
+ */
+int
+read_into_groups(WORD_LIST *list, CSV_groups *g, intmax_t count, CSV_context *ctx)
+{
+    SHELL_VAR **vars;
+    WORD_LIST *l;
+    intmax_t rows;
+    size_t grp;
+    char buf[64];
+    int i;
+
+    vars = xmalloc(g->naggs * sizeof(SHELL_VAR *));
+    for (i = 0, l = list; l; l = l->next, ++i) {
+        if ( legal_identifier(l->word->word) == 0 ) {
+            sh_invalidid(l->word->word);
+            xfree(vars);
+            return EXECUTION_FAILURE;
+        }
+        vars[i] = find_or_make_array_variable(l->word->word, 1|2);
+        if ( vars[i] == 0 || !assoc_p(vars[i]) ) {
+            if ( vars[i] )
+                builtin_error("%s: not an associative array", l->word->word);
+            xfree(vars);
+            return EXECUTION_FAILURE;
+        }
+    }
+
+    g->text.data = NULL;
+    g->text.size = g->text.used = 0;
+    g->text.allocs = 0;
+    g->text.mapped = 0;
+    g->groups = NULL;
+    g->acc = NULL;
+    g->ngroups = g->size = 0;
+    g->mask = 63;
+    g->table = xmalloc((g->mask + 1) * sizeof(size_t));
+    memset(g->table, 0, (g->mask + 1) * sizeof(size_t));
+
+    rows = aggregate_rows(g, count, ctx);
+    sync_reader(ctx);
+    init_quoting(ctx);
+
+    for (i = 0; i < g->naggs; ++i) {
+        VUNSETATTR(vars[i], att_invisible);
+        assoc_flush(assoc_cell(vars[i]));
+        for (grp = 0; grp < g->ngroups; ++grp)
+            bind_assoc_variable(vars[i], vars[i]->name, group_key(g, grp, ctx),
+                                format_aggregate(g, grp, i, buf, sizeof(buf)), 0);
+    }
+
+    xfree(g->text.data);
+    xfree(g->groups);
+    xfree(g->acc);
+    xfree(g->table);
+    xfree(vars);
+    return rows > 0 ? EXECUTION_SUCCESS : EXECUTION_FAILURE;
+}
+
+/*
+ *  Scan mode, with -S. Rows are parsed without copying or binding anything,
+ *  just to count them and check their structure. A row is malformed if a
+ *  quote is left open at eof, or if a quote turns up anywhere but at the
+ *  start of a field, or anything but a separator follows a closing quote:
+ *  the parser reads those, but not the way the writer meant.
+ */
+typedef struct CSV_stats {
+    uintmax_t rows;
+    uintmax_t bytes;            // bytes parsed, up to base
+    size_t base;                // position in the buffer counted up to
+    int min_fields, max_fields;
+    size_t longest;             // length of the longest field value
+    uintmax_t malformed;        // number of malformed rows
+    int nbad;                   // number of them listed
+    uintmax_t bad_rows[CSV_MAX_BAD];
+    uintmax_t bad_offsets[CSV_MAX_BAD];
+} CSV_stats;
+
+/*
+ *  fill_buffer, keeping count of the bytes parsed
+ */
+static inline size_t
+fill_counted(CSV_buffer *in, CSV_stats *st)
+{
+    size_t n;
+
+    if ( in->pos < in->len )
+        return in->len - in->pos;
+    st->bytes += in->pos - st->base;
+    n = fill_buffer(in);
+    st->base = in->pos;
+    return n;
+}
+
+/*
+ *  Moves past a row like skip_csv, counting its fields and noting the
+ *  length of the longest value. *bad is set if the row is malformed.
+ *
+ *  returns the separator that ended the row, or -1 at eof
+ */
+static int
+scan_row(CSV_context *ctx, CSV_stats *st, int *fields, int *bad)
+{
+    CSV_buffer *in = ctx->in;
+    size_t len, n = 0, tail = 0;
+    int c, last = 0, quote = 0, quoted = 0;
+
+    *fields = 1;
+    *bad = 0;
+    while ( fill_counted(in, st) > 0 ) {
+        len = scan_bytes(in->data + in->pos, in->len - in->pos, quote ? ctx->qstop : ctx->stop);
+        if ( len ) {
+            n += len;
+            if ( quoted && !quote )
+                tail += len;    // after the closing quote
+            last = (unsigned char) in->data[in->pos + len - 1];
+            in->pos += len;
+        }
+        if ( in->pos == in->len )
+            continue;
+
+        c = (unsigned char) in->data[in->pos++];
+        if ( c == '\0' && ctx->drop_nul )
+            continue;
+        if ( quote ) {
+            if ( fill_counted(in, st) > 0 && (unsigned char) in->data[in->pos] == ctx->q ) {
+                n++;
+                in->pos++;
+                last = c;
+            }
+            else
+                quote = 0;
+            continue;
+        }
+        if ( c == ctx->fs || is_rs(c, ctx) ) {
+            // CR of a CRLF row separator
+            if ( c != ctx->fs && c != ctx->rs && n > 0 && last == '\r' ) {
+                n--;
+                if ( tail )
+                    tail--;
+            }
+            if ( tail )
+                *bad = 1;
+            if ( n > st->longest )
+                st->longest = n;
+            if ( c != ctx->fs )
+                return c;
+            ++*fields;
+            n = tail = 0;
+            quoted = last = 0;
+            continue;
+        }
+        // a quote, which should only ever start a field
+        if ( n > 0 || quoted )
+            *bad = 1;
+        quote = quoted = 1;
+    }
+    if ( quote )
+        *bad = 1;
+    if ( n > st->longest )
+        st->longest = n;
+    return -1;
+}
+
+/*
+ *  Scans the remaining rows, or at most count rows if count is greater
+ *  than 0, and sets the elements of the associative array name to what
+ *  was found, along with the time it took and the number of reads.
+ */
+static int
+read_stats(char *name, intmax_t count, CSV_context *ctx)
+{
+    CSV_buffer *in = ctx->in;
+    SHELL_VAR *var;
+    CSV_stats st;
+    struct timespec t0, t1;
+    unsigned long reads = in->reads;
+    uintmax_t start, row_start;
+    int fields, bad, sep = 0, i;
+    char buf[64];
+    char *list, *p;
+
+    if ( legal_identifier(name) == 0 ) {
+        sh_invalidid(name);
+        return EXECUTION_FAILURE;
+    }
+    var = find_or_make_array_variable(name, 1|2);
+    if ( var == 0 || !assoc_p(var) ) {
+        if ( var )
+            builtin_error("%s: not an associative array", name);
+        return EXECUTION_FAILURE;
+    }
+
+    memset(&st, 0, sizeof(st));
+    st.base = in->pos;
+    start = in->mapped || in->seekable ? get_offset(in) : 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while ( sep >= 0 && (count <= 0 || st.rows < (uintmax_t) count) && fill_counted(in, &st) > 0 ) {
+        row_start = start + st.bytes + (in->pos - st.base);
+        sep = scan_row(ctx, &st, &fields, &bad);
+        if ( st.rows == 0 || fields < st.min_fields )
+            st.min_fields = fields;
+        if ( fields > st.max_fields )
+            st.max_fields = fields;
+        if ( bad ) {
+            if ( st.nbad < CSV_MAX_BAD ) {
+                st.bad_rows[st.nbad] = st.rows;
+                st.bad_offsets[st.nbad++] = row_start;
+            }
+            st.malformed++;
+        }
+        st.rows++;
+    }
+    st.bytes += in->pos - st.base;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    sync_reader(ctx);
+
+    VUNSETATTR(var, att_invisible);
+    assoc_flush(assoc_cell(var));
+#define SET_STAT(key, value) \
+    bind_assoc_variable(var, name, savestring(key), value, 0)
+    SET_STAT("rows", fmtumax(st.rows, 10, buf, sizeof(buf), 0));
+    SET_STAT("bytes", fmtumax(st.bytes, 10, buf, sizeof(buf), 0));
+    SET_STAT("min_fields", fmtulong(st.min_fields, 10, buf, sizeof(buf), 0));
+    SET_STAT("max_fields", fmtulong(st.max_fields, 10, buf, sizeof(buf), 0));
+    SET_STAT("longest_field", fmtumax(st.longest, 10, buf, sizeof(buf), 0));
+    SET_STAT("malformed", fmtumax(st.malformed, 10, buf, sizeof(buf), 0));
+    SET_STAT("syscalls", fmtulong(in->reads - reads, 10, buf, sizeof(buf), 0));
+    snprintf(buf, sizeof(buf), "%.6f", (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+    SET_STAT("seconds", buf);
+
+    // space separated lists of the first CSV_MAX_BAD malformed rows
+    list = p = xmalloc(st.nbad * (INT_STRLEN_BOUND(uintmax_t) + 1) + 1);
+    *p = '\0';
+    for (i = 0; i < st.nbad; ++i)
+        p += sprintf(p, i ? " %ju" : "%ju", st.bad_rows[i]);
+    SET_STAT("malformed_rows", list);
+    p = list;
+    for (i = 0; i < st.nbad; ++i)
+        p += sprintf(p, i ? " %ju" : "%ju", st.bad_offsets[i]);
+    SET_STAT("malformed_offsets", list);
+#undef SET_STAT
+    xfree(list);
+
+    return st.rows > 0 ? EXECUTION_SUCCESS : EXECUTION_FAILURE;
+}
+
+/*
+ *  Sets up the set of bytes that make the scanner decide a field must be
+ *  quoted: the quote character, the field separator and the row separator
+ *  (CR and LF by default).
+ */
+static void
+init_quoting(CSV_context *ctx)
+{
+    unsigned char set[4];
+    int i, n = 0;
+
+    if ( scan_bytes == NULL )
+        init_scanner();
+    if (ctx->q > 0)
+        set[n++] = ctx->q;
+    if (ctx->fs > 0)
+        set[n++] = ctx->fs;
+    if (ctx->rs > 0)
+        set[n++] = ctx->rs;
+    else if (ctx->rs == -1) {
+        set[n++] = '\r';
+        set[n++] = '\n';
+    }
+    ctx->quote_fields = ctx->q > 0 && n > 1;
+    for (i = 0; i < 4; ++i)
+        ctx->pstop[i] = set[i < n ? i : 0];
+}
+
+/*
+ *  Sets up the output buffer for fd, and the quoting of printed fields.
+ */
+void
+init_writer(CSV_context *ctx, int fd)
+{
+    if ( output.data == NULL )
+        output.data = xmalloc(CSV_BUFSIZE);
+    output.fd = fd;
+    output.len = 0;
+    output.error = 0;
+    ctx->out = &output;
+
+    // bash may have output of its own waiting in stdout
+    fflush(stdout);
+    init_quoting(ctx);
+}
+
+static void
+flush_output(CSV_output *out)
+{
+    ssize_t nw;
+    size_t done = 0;
+
+    while ( done < out->len && !out->error ) {
+        nw = write(out->fd, out->data + done, out->len - done);
+        if ( nw < 0 && errno != EINTR )
+            out->error = errno;
+        else if ( nw > 0 )
+            done += nw;
+    }
+    out->len = 0;
+}
+
+static inline void
+put_bytes(const char *s, size_t n, CSV_output *out)
+{
+    size_t room;
+
+    while ( n > (room = CSV_BUFSIZE - out->len) ) {
+        memcpy(out->data + out->len, s, room);
+        out->len += room;
+        s += room;
+        n -= room;
+        flush_output(out);
+    }
+    memcpy(out->data + out->len, s, n);
+    out->len += n;
+}
+
+static inline void
+put_char(int c, CSV_output *out)
+{
+    if ( out->len == CSV_BUFSIZE )
+        flush_output(out);
+    out->data[out->len++] = c;
+}
+
+/*
+ *  Writes out what is left in the output buffer.
+ *
+ *  returns EXECUTION_FAILURE, after printing an error, if any write failed
+ */
+int
+finish_writer(CSV_context *ctx)
+{
+    flush_output(ctx->out);
+    if ( ctx->out->error ) {
+        builtin_error("write error: %s", strerror(ctx->out->error));
+        return EXECUTION_FAILURE;
+    }
+    return EXECUTION_SUCCESS;
+}
+
+void
+print_field(char *word, CSV_context *ctx) {
+    CSV_output *out = ctx->out;
+    size_t len = strlen(word);
+    char *q;
+
+    if ( !ctx->quote_fields || scan_bytes(word, len, ctx->pstop) == len ) {
+        put_bytes(word, len, out);
+        return;
+    }
+    put_char(ctx->q, out);
+    while ( (q = memchr(word, ctx->q, len)) ) {
+        // copy up to and including the quote, then double it
+        put_bytes(word, q - word + 1, out);
+        put_char(ctx->q, out);
+        len -= q - word + 1;
+        word = q + 1;
+    }
+    put_bytes(word, len, out);
+    put_char(ctx->q, out);
+}
+
+void
+print_eor(CSV_context *ctx) {
+    if ( ctx->rs == -1 )
+        put_bytes("\r\n", 2, ctx->out);
+    else
+        put_char(ctx->rs, ctx->out);
+}
+
+void
+print_array(ARRAY *a, CSV_context *ctx) {
+    ARRAY_ELEMENT *ae;
+    int first_printed = 0;
+
+    if ( !a )
+        return;
+
+    for (ae = element_forw(a->head); ae != a->head; ae = element_forw(ae)) {
+        if ( skip_field(element_index(ae), ctx) )
+            continue;
+        if ( first_printed )
+            put_char(ctx->fs, ctx->out);
+        print_field(element_value(ae), ctx);
+        first_printed = 1;
+    }
+    print_eor(ctx);
+}
+
+void
+print_words(WORD_LIST *list, CSV_context *ctx) {
+    arrayind_t i;
+    int first_printed = 0;
+
+    for (i = 0; list; list = list->next, ++i) {
+        if ( skip_field(i, ctx) )
+            continue;
+        if ( first_printed )
+            put_char(ctx->fs, ctx->out);
+        print_field(list->word->word, ctx);
+        first_printed = 1;
+    }
+    print_eor(ctx);
+}
+
+static char unsigned assoc_no_header_warn = 0;
+
+void
+print_assoc(HASH_TABLE *hash, ARRAY *header, CSV_context *ctx) {
+    ARRAY_ELEMENT *ae;
+    WORD_LIST *words;
+    int first_printed = 0;
+    char *data;
+
+    if ( !hash ) {
+        print_eor(ctx);
+        return;
+    }
+
+    if ( !header ) {
+        if ( !assoc_no_header_warn++ )
+            builtin_warning("Associative array without header. Values will be printed in arbitrary order"); 
+        words = assoc_to_word_list(hash);
+        print_words(words, ctx);
+        dispose_words(words);
+        return;
+    }
+
+    for (ae = element_forw(header->head); ae != header->head; ae = element_forw(ae)) {
+        if ( skip_field(element_index(ae), ctx) )
+            continue;
+        if ( first_printed )
+            put_char(ctx->fs, ctx->out);
+        data = assoc_reference(hash, element_value(ae));
+        if (data)
+            print_field(data, ctx);
+        first_printed = 1;
+    }
+    print_eor(ctx);
+}
+
+/*
+ *  Element lookup by index for the arrays printed with -pb. Arrays whose
+ *  indices are 0 to n-1 are indexed directly, others are binary searched.
+ */
+typedef struct CSV_column {
+    ARRAY_ELEMENT **elements;   // the elements, in index order
+    size_t n;
+    int dense;                  // 1 if elements[i] has index i
+} CSV_column;
+
+static void
+make_column(CSV_column *col, ARRAY *a)
+{
+    ARRAY_ELEMENT *ae;
+    size_t i = 0;
+
+    col->n = array_num_elements(a);
+    col->elements = xmalloc((col->n + 1) * sizeof(ARRAY_ELEMENT *));
+    for (ae = element_forw(a->head); ae != a->head && i < col->n; ae = element_forw(ae))
+        col->elements[i++] = ae;
+    col->n = i;
+    col->dense = col->n == 0 || element_index(col->elements[col->n - 1]) == (arrayind_t) col->n - 1;
+}
+
+static char *
+column_value(CSV_column *col, arrayind_t ind)
+{
+    size_t lo = 0, hi = col->n, mid;
+
+    if ( col->dense )
+        return ind >= 0 && (size_t) ind < col->n ? element_value(col->elements[ind]) : NULL;
+    while ( lo < hi ) {
+        mid = lo + (hi - lo) / 2;
+        if ( element_index(col->elements[mid]) < ind )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < col->n && element_index(col->elements[lo]) == ind ? element_value(col->elements[lo]) : NULL;
+}
+
+/*
+ *  Bulk printing. Prints one row per index, with the element at that index
+ *  of each of the ncolumns arrays as fields. If order is given, its values
+ *  are the indices of the rows to print, in order, like the array asort -i
+ *  produces. Otherwise every index set in any of the arrays is printed, in
+ *  increasing order.
+ *
+ *  returns EXECUTION_FAILURE if order holds something that is not an index
+ */
+int
+print_columns(ARRAY **columns, int ncolumns, ARRAY *order, CSV_context *ctx) {
+    ARRAY_ELEMENT **cursor, *ae;
+    CSV_column *cols;
+    arrayind_t ind;
+    intmax_t val;
+    int k, first_printed, ret = EXECUTION_SUCCESS;
+    char *value;
+
+    if ( order ) {
+        cols = xmalloc(ncolumns * sizeof(CSV_column));
+        for (k = 0; k < ncolumns; ++k)
+            make_column(&cols[k], columns[k]);
+        for (ae = element_forw(order->head); ae != order->head; ae = element_forw(ae)) {
+            if ( !legal_number(element_value(ae), &val) || val < 0 ) {
+                builtin_error("%s: invalid index", element_value(ae));
+                ret = EXECUTION_FAILURE;
+                break;
+            }
+            first_printed = 0;
+            for (k = 0; k < ncolumns; ++k) {
+                if ( skip_field(k, ctx) )
+                    continue;
+                if ( first_printed )
+                    put_char(ctx->fs, ctx->out);
+                if ( (value = column_value(&cols[k], val)) )
+                    print_field(value, ctx);
+                first_printed = 1;
+            }
+            print_eor(ctx);
+        }
+        for (k = 0; k < ncolumns; ++k)
+            xfree(cols[k].elements);
+        xfree(cols);
+        return ret;
+    }
+
+    // walk all the arrays side by side
+    cursor = xmalloc(ncolumns * sizeof(ARRAY_ELEMENT *));
+    for (k = 0; k < ncolumns; ++k)
+        cursor[k] = element_forw(columns[k]->head);
+    for (;;) {
+        ind = -1;
+        for (k = 0; k < ncolumns; ++k)
+            if ( cursor[k] != columns[k]->head && (ind == -1 || element_index(cursor[k]) < ind) )
+                ind = element_index(cursor[k]);
+        if ( ind == -1 )
+            break;
+        first_printed = 0;
+        for (k = 0; k < ncolumns; ++k) {
+            value = NULL;
+            if ( cursor[k] != columns[k]->head && element_index(cursor[k]) == ind ) {
+                value = element_value(cursor[k]);
+                cursor[k] = element_forw(cursor[k]);
+            }
+            if ( skip_field(k, ctx) )
+                continue;
+            if ( first_printed )
+                put_char(ctx->fs, ctx->out);
+            if ( value )
+                print_field(value, ctx);
+            first_printed = 1;
+        }
+        print_eor(ctx);
+    }
+    xfree(cursor);
+    return ret;
+}
+
+/*
+ *  Sharding, with -O. Rows are passed through unchanged, as they are in the
+ *  input, and each goes to one of the fds: the next one in turn, or with -k
+ *  the one picked by the hash of a key field, so that rows with the same
+ *  key end up together. Every fd has an output buffer of its own.
+ */
+typedef struct CSV_shards {
+    int n;
+    CSV_output *out;
+    int key;                // field hashed, or -1 for round robin
+    int header;             // 1 if the first row goes to every fd
+    CSV_arena raw;          // the row, if the input is not mapped
+} CSV_shards;
+
+/*
+ *  Compiles the -O list of fds, kept until the next call like the -f
+ *  bitmap.
+ *
+ *  returns 0 if the list is illegal
+ */
+static CSV_output *shard_storage = NULL;
+
+static int
+parse_shards(char *s, CSV_shards *sh)
+{
+    CSV_output *out = NULL;
+    intmax_t fd;
+    int n = 0;
+    char *w;
+
+    for (w = strtok(s, ","); w; w = strtok(NULL, ",")) {
+        if ( !legal_number(w, &fd) || fd < 0 || fd != (int) fd || n == CSV_MAX_SHARDS ) {
+            xfree(out);
+            return 0;
+        }
+        out = xrealloc(out, (n + 1) * sizeof(CSV_output));
+        out[n].fd = fd;
+        out[n].data = NULL;
+        out[n].len = 0;
+        out[n].error = 0;
+        n++;
+    }
+    if ( n == 0 )
+        return 0;
+    xfree(shard_storage);
+    sh->out = shard_storage = out;
+    sh->n = n;
+    return 1;
+}
+
+/*
+ *  Moves past the bytes in[pos..pos+len), copying them to the raw row
+ *  unless the input is mapped, where the row can be taken from the mapping.
+ */
+static inline void
+take_raw(CSV_buffer *in, size_t len, CSV_shards *sh)
+{
+    if ( !in->mapped ) {
+        arena_reserve(&sh->raw, len);
+        memcpy(sh->raw.data + sh->raw.used, in->data + in->pos, len);
+        sh->raw.used += len;
+    }
+    in->pos += len;
+}
+
+/*
+ *  Hashes the value of the raw field s[0..n), with the quotes taken out the
+ *  way read_csv_field does, so "a" and a are the same key, and a CR at the
+ *  end left out if crlf is set. FNV-1a, which gives the same shard for a
+ *  key every time.
+ */
+#define FNV_STEP(h, c) (((h) ^ (c)) * 1099511628211ULL)
+
+static uint64_t
+hash_raw_field(const char *s, size_t n, int crlf, CSV_context *ctx)
+{
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+    int c, quote = 0, cr = 0;
+
+    for (i = 0; i < n; ++i) {
+        c = (unsigned char) s[i];
+        if ( c == ctx->q && ctx->q ) {
+            if ( !quote ) {
+                quote = 1;
+                continue;
+            }
+            if ( i + 1 >= n || (unsigned char) s[i+1] != ctx->q ) {
+                quote = 0;
+                continue;
+            }
+            ++i;
+        }
+        else if ( c == '\0' && ctx->drop_nul )
+            continue;
+        // hold back a CR until it is known not to be the last byte
+        if ( cr )
+            h = FNV_STEP(h, '\r');
+        if ( !(cr = c == '\r') )
+            h = FNV_STEP(h, c);
+    }
+    if ( cr && !crlf )
+        h = FNV_STEP(h, '\r');
+    return h;
+}
+
+/*
+ *  Moves past the next row like skip_csv, setting *row and *len to its
+ *  bytes, separator included, and *shard to the fd it goes to if sh->key is
+ *  not -1.
+ *
+ *  returns the separator that ended the row, or -1 at eof
+ */
+static int
+next_raw_row(CSV_context *ctx, CSV_shards *sh, char **row, size_t *len, int *shard)
+{
+    CSV_buffer *in = ctx->in;
+    size_t start = in->pos, n, key_from = 0, key_to = (size_t) -1, off;
+    int c, col = 0, quote = 0, sep = -1, crlf;
+
+    sh->raw.used = 0;
+#define RAW_OFFSET (in->mapped ? in->pos - start : sh->raw.used)
+    while ( fill_buffer(in) > 0 ) {
+        n = scan_bytes(in->data + in->pos, in->len - in->pos, quote ? ctx->qstop : ctx->stop);
+        take_raw(in, n, sh);
+        if ( in->pos == in->len )
+            continue;
+
+        c = (unsigned char) in->data[in->pos];
+        take_raw(in, 1, sh);
+        if ( quote ) {
+            if ( c == ctx->q && fill_buffer(in) > 0 && (unsigned char) in->data[in->pos] == ctx->q )
+                take_raw(in, 1, sh);
+            else if ( c == ctx->q )
+                quote = 0;
+            continue;
+        }
+        if ( c == '\0' && ctx->drop_nul )
+            continue;
+        if ( c == ctx->fs && !is_rs(c, ctx) ) {
+            off = RAW_OFFSET;
+            if ( col == sh->key )
+                key_to = off - 1;
+            if ( ++col == sh->key )
+                key_from = off;
+            continue;
+        }
+        if ( is_rs(c, ctx) ) {
+            sep = c;
+            break;
+        }
+        quote = 1;
+    }
+    *len = RAW_OFFSET;
+#undef RAW_OFFSET
+    *row = in->mapped ? in->data + start : sh->raw.data;
+
+    if ( sh->key >= 0 ) {
+        crlf = 0;
+        if ( col == sh->key ) {
+            // the last field, without the row separator
+            key_to = *len - (sep >= 0);
+            crlf = ctx->rs == -1 && sep == '\n' && sep != ctx->rs;
         }
+        *shard = key_to == (size_t) -1 ? 0 : hash_raw_field(*row + key_from, key_to - key_from, crlf, ctx) % sh->n;
     }
-    if (ret <= 0)
-        return -1;
-    return c;
+    return sep;
 }
 
-int
-read_into_array(SHELL_VAR *array, SHELL_VAR *header, CSV_context *ctx) {
-
-    int ret;
-    char *key, *value;
-    char ibuf[INT_STRLEN_BOUND (intmax_t) + 1]; // used by fmtulong
-    
-    if ( header && array_empty(array_cell(header)) )
-        read_into_array(header, NULL, ctx);
+/*
+ *  Writes a row to out. Rows at least as large as the buffer are spliced
+ *  straight from a mapped file into a pipe, where the system allows it.
+ */
+static void
+put_row(const char *row, size_t len, CSV_output *out, CSV_buffer *in)
+{
+#if defined(SPLICE_F_MOVE)
+    loff_t off;
+    ssize_t nw;
 
-    ctx->col = -1;
-    while ( (ret = read_csv_field(&value, ctx)) >= 0 ) {
-        if ( !skip_field(ctx->col, ctx) ) {
-            if ( assoc_p(array) ) {
-                key = NULL;
-                if ( header )
-                    key = array_reference(array_cell(header), ctx->col);
-                if ( key == NULL || key[0] == '\0' )
-                    key = fmtulong(ctx->col, 10, ibuf, sizeof(ibuf), 0);
-                bind_assoc_variable(array, array->name, savestring(key), value, 0);
-            }
-            else
-                bind_array_element(array, ctx->col, value, 0);
+    if ( len >= CSV_BUFSIZE && in->mapped && !out->error ) {
+        flush_output(out);
+        off = row - in->data;
+        while ( len > 0 && (nw = splice(in->fd, &off, out->fd, NULL, len, SPLICE_F_MOVE)) > 0 ) {
+            row += nw;
+            len -= nw;
         }
-        xfree(value);
-        if ( ret == ctx->rs || ctx->rs == -1 && ret == '\n' )
-            return EXECUTION_SUCCESS;
-    }
-    if ( value[0] && !skip_field(ctx->col, ctx) ) {
-        if (assoc_p(array)) {
-            key = NULL;
-            if ( header )
-                key = array_reference(array_cell(header), ctx->col);
-            if ( key == NULL || key[0] == '\0' )
-                key = fmtulong(ctx->col, 10, ibuf, sizeof(ibuf), 0);
-            bind_assoc_variable(array, array->name, savestring(key), value, 0);
-        }
-        else
-            bind_array_element(array, ctx->col, value, 0);
-        xfree(value);
-        return EXECUTION_SUCCESS;
     }
-    xfree(value);
-    return EXECUTION_FAILURE;
-
+#endif
+    put_bytes(row, len, out);
 }
 
-void
-print_field(char *word, CSV_context *ctx) {
-    char special[5];
-    size_t i, n = 0;
+/*
+ *  Sends the remaining rows, or at most count rows if count is greater than
+ *  0, to the fds in sh. The first row, if it is a header, goes to all of
+ *  them and is not counted.
+ */
+static int
+shard_rows(CSV_shards *sh, intmax_t count, CSV_context *ctx)
+{
+    CSV_buffer *in = ctx->in;
+    intmax_t rows = 0;
+    char *row;
+    size_t len;
+    int i, shard = 0, sep = 0, ret = EXECUTION_SUCCESS;
 
-    if (ctx->q > 0)
-        special[n++] = ctx->q;
-    if (ctx->fs > 0)
-        special[n++] = ctx->fs;
-    if (ctx->rs > 0)
-        special[n++] = ctx->rs;
-    else if (ctx->rs == -1) {
-        special[n++] = '\r';
-        special[n++] = '\n';
+    // bash may have output of its own waiting in stdout
+    fflush(stdout);
+    for (i = 0; i < sh->n; ++i)
+        sh->out[i].data = xmalloc(CSV_BUFSIZE);
+    sh->raw.data = NULL;
+    sh->raw.size = sh->raw.used = 0;
+    sh->raw.allocs = 0;
+    sh->raw.mapped = 0;
+
+    if ( sh->header && fill_buffer(in) > 0 ) {
+        sep = next_raw_row(ctx, sh, &row, &len, &shard);
+        for (i = 0; i < sh->n; ++i)
+            put_row(row, len, &sh->out[i], in);
+        shard = 0;
     }
-    special[n] = '\0';
+    for (; sep >= 0 && (count <= 0 || rows < count) && fill_buffer(in) > 0; ++rows) {
+        sep = next_raw_row(ctx, sh, &row, &len, &shard);
+        put_row(row, len, &sh->out[shard], in);
+        if ( sh->key < 0 && ++shard == sh->n )
+            shard = 0;
+    }
+    sync_reader(ctx);
 
-    if ( strpbrk(word, special) ) {
-        putchar(ctx->q);
-        while (*word) {
-            if (*word == ctx->q)
-                putchar(ctx->q);
-            putchar(*word);
-            word++;
+    for (i = 0; i < sh->n; ++i) {
+        flush_output(&sh->out[i]);
+        if ( sh->out[i].error ) {
+            builtin_error("%d: write error: %s", sh->out[i].fd, strerror(sh->out[i].error));
+            ret = EXECUTION_FAILURE;
         }
-        putchar(ctx->q);
+        xfree(sh->out[i].data);
     }
-    else
-        printf("%s", word);
+    xfree(sh->raw.data);
+    return rows > 0 || ret != EXECUTION_SUCCESS ? ret : EXECUTION_FAILURE;
 }
 
-void
-print_array(ARRAY *a, CSV_context *ctx) {
-    ARRAY_ELEMENT *ae;
-    int first_printed = 0;
+/*
+ *  Joins, with -J. The rows read are looked up in a table made with -L by
+ *  the values of their key fields, through a hash index of the table's key
+ *  fields made for the call, and for every table row with the same key, the
+ *  row is printed followed by the fields of the table row that are not key
+ *  fields. With -l, rows without a match are printed too, with the table's
+ *  fields empty. Only the table is kept in memory; the rows read are
+ *  streamed through.
+ */
+typedef struct CSV_join {
+    CSV_table *table;
+    int *keys, nkeys;           // key fields of the rows read
+    int *tkeys, ntkeys;         // key fields of the table
+    int left;                   // 1 for a left join
+    size_t *head;               // first table row + 1 of each hash chain
+    size_t *next;               // next table row + 1 in the chain
+    size_t mask;                // number of chains - 1
+} CSV_join;
 
-    if ( !a )
-        return;
+/*
+ *  Like the -g list, the -k and -K lists are kept until the next call.
+ */
+static int *join_key_storage = NULL;
+static int *table_key_storage = NULL;
 
-    for (ae = element_forw(a->head); ae != a->head; ae = element_forw(ae)) {
-        if ( skip_field(element_index(ae), ctx) )
-            continue;
-        if ( first_printed )
-            putchar(ctx->fs);
-        print_field(element_value(ae), ctx);
-        first_printed = 1;
+// the key when there is no -k
+static int first_field = 0;
+
+#define KEY_STEP(h, s) \
+    do { const unsigned char *p_ = (const unsigned char *) (s); \
+         while ( *p_ ) (h) = FNV_STEP(h, *p_++); \
+         (h) = FNV_STEP(h, 0); } while (0)
+
+/*
+ *  Makes the hash index of the table's rows by their key fields.
+ */
+static void
+index_table(CSV_join *j)
+{
+    CSV_table *t = j->table;
+    uint64_t h;
+    size_t r, size = 16;
+    int i;
+
+    while ( size < 2 * t->nrows )
+        size *= 2;
+    j->mask = size - 1;
+    j->head = xmalloc(size * sizeof(size_t));
+    memset(j->head, 0, size * sizeof(size_t));
+    j->next = xmalloc((t->nrows ? t->nrows : 1) * sizeof(size_t));
+    // backwards, so that the chains list rows in table order
+    for (r = t->nrows; r-- > 0; ) {
+        h = 14695981039346656037ULL;
+        for (i = 0; i < j->ntkeys; ++i)
+            KEY_STEP(h, table_cell(t, r, j->tkeys[i]));
+        j->next[r] = j->head[h & j->mask];
+        j->head[h & j->mask] = r + 1;
     }
-    if ( ctx->rs == -1 )
-        printf("\r\n");
-    else
-        putchar(ctx->rs);
 }
 
-static char unsigned assoc_no_header_warn = 0;
+/*
+ *  returns 1 if the key fields of table row r are the same as those of
+ *  the row read
+ */
+static int
+join_match(CSV_join *j, size_t r, char **values)
+{
+    int i;
 
-void
-print_assoc(HASH_TABLE *hash, ARRAY *header, CSV_context *ctx) {
-    ARRAY_ELEMENT *ae;
-    int first_printed = 0;
-    char *data;
+    for (i = 0; i < j->nkeys; ++i)
+        if ( !STREQ(table_cell(j->table, r, j->tkeys[i]), values[i]) )
+            return 0;
+    return 1;
+}
 
-    if ( !hash ) {
-        if ( ctx->rs == -1 )
-            printf("\r\n");
-        else
-            putchar(ctx->rs);
-        return;
-    }
+/*
+ *  Prints the row read, and the fields of table row r, or empty fields if
+ *  r is (size_t) -1.
+ */
+static void
+print_joined(CSV_join *j, CSV_field *fields, int n, size_t r, CSV_context *ctx)
+{
+    CSV_table *t = j->table;
+    int c, i;
 
-    if ( !header ) {
-        if ( !assoc_no_header_warn++ )
-            builtin_warning("Associative array without header. Values will be printed in arbitrary order"); 
-        print_array(array_from_word_list(assoc_to_word_list(hash)), ctx);
-        return;
+    for (c = 0; c < n; ++c) {
+        if ( c )
+            put_char(ctx->fs, ctx->out);
+        print_field(field_value(ctx, fields[c]), ctx);
     }
-
-    for (ae = element_forw(header->head); ae != header->head; ae = element_forw(ae)) {
-        if ( skip_field(element_index(ae), ctx) )
+    for (c = 0; c < t->ncols; ++c) {
+        for (i = 0; i < j->ntkeys && j->tkeys[i] != c; ++i)
+            ;
+        if ( i < j->ntkeys )
             continue;
-        if ( first_printed )
-            putchar(ctx->fs);
-        data = assoc_reference(hash, element_value(ae));
-        if (data)
-            print_field(data, ctx);
-        first_printed = 1;
+        if ( n || c )
+            put_char(ctx->fs, ctx->out);
+        if ( r != (size_t) -1 )
+            print_field(table_cell(t, r, c), ctx);
     }
-    if ( ctx->rs == -1 )
-        printf("\r\n");
-    else
-        printf("\n");
+    print_eor(ctx);
+}
+
+/*
+ *  Joins the remaining rows, or at most count rows if count is greater
+ *  than 0, with the table, printing the result to standard output.
+ *
+ *  returns the number of rows read
+ */
+static intmax_t
+join_rows(CSV_join *j, intmax_t count, CSV_context *ctx)
+{
+    CSV_field *fields = NULL;
+    char **values = xmalloc(j->nkeys * sizeof(char *));
+    intmax_t rows;
+    uint64_t h;
+    size_t r;
+    int i, n, size = 0, sep, matched;
+
+    index_table(j);
+    for (rows = 0; (count <= 0 || rows < count) && start_row(ctx); ++rows) {
+        n = 0;
+        do {
+            if ( n == size ) {
+                size = size ? 2 * size : 64;
+                fields = xrealloc(fields, size * sizeof(CSV_field));
+            }
+            sep = next_field(&fields[n++], ctx);
+        } while ( sep >= 0 && !is_rs(sep, ctx) );
+
+        h = 14695981039346656037ULL;
+        for (i = 0; i < j->nkeys; ++i) {
+            values[i] = j->keys[i] < n ? field_value(ctx, fields[j->keys[i]]) : "";
+            KEY_STEP(h, values[i]);
+        }
+        matched = 0;
+        for (r = j->head[h & j->mask]; r; r = j->next[r - 1]) {
+            if ( join_match(j, r - 1, values) ) {
+                print_joined(j, fields, n, r - 1, ctx);
+                matched = 1;
+            }
+        }
+        if ( !matched && j->left )
+            print_joined(j, fields, n, (size_t) -1, ctx);
+        if ( sep < 0 ) {
+            ++rows;
+            break;
+        }
+    }
+    xfree(fields);
+    xfree(values);
+    xfree(j->head);
+    xfree(j->next);
+    return rows;
 }
 
 int
@@ -341,12 +4360,43 @@ csv_builtin(WORD_LIST *list)
     SHELL_VAR *var;
     SHELL_VAR *array;
     SHELL_VAR *header;
+    SHELL_VAR *order = NULL;
     ARRAY *a = NULL;
+    ARRAY **columns;
     char *word;
     char *buf = NULL;
-    intmax_t intval;
-    int opt, sep, eor, eos, ret;
+    CSV_field field;
+    intmax_t intval, count = 0, jobs = 1;
+    int opt, sep, eor, ret, i, n;
     int use_array = 0;
+    int bulk = 0;
+    int flush = 0;
+    int fd_given = 0;
+    int fs_given = 0;
+    int plain = 0;
+    int scan = 0;
+    CSV_shards shards = { 0, NULL, -1, 0 };
+    char *load = NULL;
+    char *table_name = NULL;
+    CSV_table *table;
+    char *join_name = NULL;
+    char *cache_path = NULL;
+    char *callback = NULL;
+    intmax_t quantum = 5000;
+    CSV_join join = { NULL, NULL, 0, NULL, 0, 0 };
+    int cut_given = 0;
+    int or = 0;
+    int seek = 0;
+    intmax_t row = 0;
+    char *index_path = NULL;
+    char *prepare = NULL;
+    CSV_handle *handle = NULL;
+    WORD_LIST *names;
+    WORD_LIST *ordered = NULL;
+    int nopts = 0;
+    char *order_name = NULL;
+    CSV_groups groups = { 0, NULL, 0, NULL };
+    int *cols;
 
     CSV_context ctx = {
         0,      // fd
@@ -354,26 +4404,123 @@ csv_builtin(WORD_LIST *list)
         -1,     // rs
         ',',    // fs
         '"',    // q
-        0,      // cut array
-        0,      // to_inf
-        0       // print_mode
+        NULL,   // cut bitmap
+        0,      // cut_len
+        INT_MAX,// cut_from
+        INT_MAX,// last
+        0,      // print_mode
+        NULL    // input buffer, set by init_reader
     };
 
 
     reset_internal_getopt();
-    while ( (opt = internal_getopt(list, "ad:f:F:pq:u:")) != -1 ) {
+    while ( (opt = internal_getopt(list, "aA:bc:C:d:f:F:g:hH:i:j:J:k:K:lL:mn:oO:pP:q:Rs:StT:u:w:W:x:X:z:")) != -1 ) {
+        nopts++;
         switch (opt) {
             case 'a': use_array=1; break;
-            case 'd': ctx.rs = list_optarg[0]; break;
+            case 'A':
+                if (parse_aggregates(list_optarg, &groups) == 0) {
+                    builtin_error("-A: illegal aggregate list");
+                    return EXECUTION_FAILURE;
+                }
+                break;
+            case 'b': bulk=1; break;
+            case 'c':
+                ret = legal_number(list_optarg, &quantum);
+                if (ret == 0 || quantum <= 0) {
+                    builtin_error ("%s: invalid callback quantum", list_optarg);
+                    return EXECUTION_FAILURE;
+                }
+                break;
+            case 'C': callback = list_optarg; break;
+            case 'd': ctx.rs = (unsigned char) list_optarg[0]; break;
             case 'f':
                 if (parse_list(list_optarg, &ctx) == 0) {
                     builtin_error("-f: illegal list value");
                     return EXECUTION_FAILURE;
                 }
+                cut_given = 1;
+                break;
+            case 'F': ctx.fs = (unsigned char) list_optarg[0]; fs_given = 1; break;
+            case 'g':
+                if (parse_keys(list_optarg, &groups) == 0) {
+                    builtin_error("-g: illegal list value");
+                    return EXECUTION_FAILURE;
+                }
+                break;
+            case 'h': shards.header = 1; break;
+            case 'H':
+                if ((handle = find_handle(list_optarg)) == NULL) {
+                    builtin_error("%s: no such reader", list_optarg);
+                    return EXECUTION_FAILURE;
+                }
+                break;
+            case 'i': order_name = list_optarg; break;
+            case 'j':
+                ret = legal_number(list_optarg, &jobs);
+                if (ret == 0 || jobs < 0) {
+                    builtin_error ("%s: invalid number of jobs", list_optarg);
+                    return EXECUTION_FAILURE;
+                }
+                if (jobs == 0)
+                    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+                if (jobs > CSV_MAX_JOBS)
+                    jobs = CSV_MAX_JOBS;
+                if (jobs > 1)
+                    ctx.map = 1;
+                break;
+            case 'J': join_name = list_optarg; break;
+            case 'k':
+                if ((join.nkeys = parse_fields(list_optarg, &join.keys, &join_key_storage)) == 0) {
+                    builtin_error("-k: illegal list value");
+                    return EXECUTION_FAILURE;
+                }
+                shards.key = join.keys[0];
+                break;
+            case 'K':
+                if ((join.ntkeys = parse_fields(list_optarg, &join.tkeys, &table_key_storage)) == 0) {
+                    builtin_error("-K: illegal list value");
+                    return EXECUTION_FAILURE;
+                }
+                break;
+            case 'l': join.left = 1; break;
+            case 'm': ctx.map = 1; break;
+            case 'L': load = list_optarg; break;
+            case 'n':
+                ret = legal_number(list_optarg, &count);
+                if (ret == 0 || count < 0) {
+                    builtin_error ("%s: invalid row count", list_optarg);
+                    return EXECUTION_FAILURE;
+                }
+                break;
+            case 'o':
+                if (ctx.npreds == 0) {
+                    builtin_usage();
+                    return EX_USAGE;
+                }
+                or = 1;
+                break;
+            case 'O':
+                if (parse_shards(list_optarg, &shards) == 0) {
+                    builtin_error("-O: illegal list value");
+                    return EXECUTION_FAILURE;
+                }
                 break;
-            case 'F': ctx.fs = list_optarg[0]; break;
             case 'p': ctx.print_mode = 1; break;
-            case 'q': ctx.q = list_optarg[0]; break;
+            case 'P': prepare = list_optarg; break;
+            case 'q': ctx.q = (unsigned char) list_optarg[0]; break;
+            case 'R': flush = 1; break;
+            case 's':
+                ret = legal_number(list_optarg, &row);
+                if (ret == 0 || row < 0) {
+                    builtin_error ("%s: invalid row number", list_optarg);
+                    return EXECUTION_FAILURE;
+                }
+                seek = 1;
+                break;
+            case 'S': scan = 1; break;
+            case 't': plain = 1; break;
+            case 'T': table_name = list_optarg; break;
             case 'u':
                 ret = legal_number(list_optarg, &intval);
                 if (ret == 0 || intval < 0 || intval != (int) intval) {
@@ -381,6 +4528,32 @@ csv_builtin(WORD_LIST *list)
                     return EXECUTION_FAILURE;
                 }
                 ctx.fd = intval;
+                fd_given = 1;
+                break;
+            case 'w':
+                if (parse_predicate(list_optarg, or, &ctx) == 0) {
+                    builtin_error("%s: illegal predicate", list_optarg);
+                    return EXECUTION_FAILURE;
+                }
+                or = 0;
+                break;
+            case 'W':
+                if (parse_widths(list_optarg, &ctx) == 0) {
+                    builtin_error("-W: illegal list value");
+                    return EXECUTION_FAILURE;
+                }
+                break;
+            case 'x': index_path = list_optarg; break;
+            case 'X': cache_path = list_optarg; break;
+            case 'z':
+                for (i = CODEC_AUTO; i <= CODEC_ZSTD; ++i)
+                    if (strcmp(list_optarg, codec_names[i]) == 0)
+                        break;
+                if (i > CODEC_ZSTD) {
+                    builtin_error("%s: invalid compression", list_optarg);
+                    return EXECUTION_FAILURE;
+                }
+                ctx.codec = i;
                 break;
             CASE_HELPOPT;   // --help handler in bash-4.4
             default:
@@ -388,13 +4561,276 @@ csv_builtin(WORD_LIST *list)
                 return EX_USAGE;
         }
     }
-    list = loptend;
+    list = names = loptend;
+
+    // neither TSV nor fixed width fields are quoted
+    if ( plain || ctx.widths )
+        ctx.q = '\0';
+    if ( plain && !fs_given )
+        ctx.fs = '\t';
+
+    if ( handle ) {
+        if ( nopts > 1 || list ) {
+            builtin_usage();
+            return EX_USAGE;
+        }
+        ctx = handle->ctx;
+        use_array = handle->use_array;
+        list = names = handle->words;
+    }
+
+    if ( table_name ) {
+        if ( nopts > 1 + use_array ) {
+            builtin_usage();
+            return EX_USAGE;
+        }
+        if ( list == 0 ) {
+            drop_table(table_name);
+            return EXECUTION_SUCCESS;
+        }
+        if ( (table = find_table(table_name)) == NULL ) {
+            builtin_error("%s: no such table", table_name);
+            return EXECUTION_FAILURE;
+        }
+        return table_command(table, list, use_array);
+    }
+
+    if ( callback && (!bulk || ctx.print_mode || cache_path) ) {
+        builtin_usage();
+        return EX_USAGE;
+    }
+
+    // a cache holds all the rows of the file
+    if ( cache_path && (!load && !bulk || ctx.print_mode || count || seek || index_path || ctx.npreds) ) {
+        builtin_usage();
+        return EX_USAGE;
+    }
+
+    if ( prepare ) {
+        if ( bulk || ctx.print_mode || flush || seek || index_path || order_name || or
+             || groups.nkeys || groups.naggs || scan || shards.n || load || join_name ) {
+            builtin_usage();
+            return EX_USAGE;
+        }
+        for ( ; list; list = list->next) {
+            if ( legal_identifier (list->word->word) == 0 && valid_array_reference (list->word->word, 0) == 0 ) {
+                sh_invalidid(list->word->word);
+                return EXECUTION_FAILURE;
+            }
+        }
+        save_handle(prepare, &ctx, use_array, names);
+        return EXECUTION_SUCCESS;
+    }
+
+    if ( flush ) {
+        flush_buffer(ctx.fd);
+        return EXECUTION_SUCCESS;
+    }
+
+    if ( list == 0 && index_path && !seek && !ctx.print_mode && !shards.n && !load && !join_name ) {
+        // just bring the index up to date, and leave the offset alone
+        init_reader(&ctx);
+        intval = get_offset(ctx.in);
+        ret = get_index(index_path, &ctx) ? EXECUTION_SUCCESS : EXECUTION_FAILURE;
+        set_offset(ctx.in, intval);
+        sync_reader(&ctx);
+        return ret;
+    }
+
+    if ( join.nkeys && shards.n == 0 && !join_name || shards.header && shards.n == 0 && !bulk
+         || (join.ntkeys || join.left) && !join_name ) {
+        builtin_usage();
+        return EX_USAGE;
+    }
+    if ( shards.n ) {
+        if ( join.nkeys > 1 || join_name || list || use_array || bulk || ctx.print_mode || cut_given || ctx.npreds || ctx.widths
+             || groups.nkeys || groups.naggs || scan || order_name || load ) {
+            builtin_usage();
+            return EX_USAGE;
+        }
+        init_reader(&ctx);
+        if ( seek && !seek_row(row, index_path, &ctx) ) {
+            sync_reader(&ctx);
+            return EXECUTION_FAILURE;
+        }
+        return shard_rows(&shards, count, &ctx);
+    }
+
+    if ( load ) {
+        if ( list || use_array || bulk || ctx.print_mode || groups.nkeys || groups.naggs || scan
+             || order_name || cache_path && cut_given ) {
+            builtin_usage();
+            return EX_USAGE;
+        }
+        init_reader(&ctx);
+        if ( cache_path ) {
+            table = get_cache(cache_path, &ctx);
+            sync_reader(&ctx);
+            if ( table == NULL )
+                return EXECUTION_FAILURE;
+            add_table(table, load);
+            return table->nrows > 0 ? EXECUTION_SUCCESS : EXECUTION_FAILURE;
+        }
+        if ( seek && !seek_row(row, index_path, &ctx) ) {
+            sync_reader(&ctx);
+            return EXECUTION_FAILURE;
+        }
+        intval = load_table(load, count, &ctx);
+        sync_reader(&ctx);
+        return intval > 0 ? EXECUTION_SUCCESS : EXECUTION_FAILURE;
+    }
+
+    if ( join_name ) {
+        if ( list || use_array || bulk || ctx.print_mode || cut_given || groups.nkeys || groups.naggs
+             || scan || order_name ) {
+            builtin_usage();
+            return EX_USAGE;
+        }
+        if ( (join.table = find_table(join_name)) == NULL ) {
+            builtin_error("%s: no such table", join_name);
+            return EXECUTION_FAILURE;
+        }
+        if ( join.nkeys == 0 ) {
+            join.keys = &first_field;
+            join.nkeys = 1;
+        }
+        if ( join.ntkeys == 0 ) {
+            join.tkeys = join.keys;
+            join.ntkeys = join.nkeys;
+        }
+        if ( join.ntkeys != join.nkeys ) {
+            builtin_error("-K: %d fields for %d", join.ntkeys, join.nkeys);
+            return EXECUTION_FAILURE;
+        }
+        init_reader(&ctx);
+        if ( seek && !seek_row(row, index_path, &ctx) ) {
+            sync_reader(&ctx);
+            return EXECUTION_FAILURE;
+        }
+        init_writer(&ctx, 1);
+        intval = join_rows(&join, count, &ctx);
+        sync_reader(&ctx);
+        ret = finish_writer(&ctx);
+        return intval > 0 ? ret : EXECUTION_FAILURE;
+    }
 
-    if ( list == 0 ) {
+    if ( list == 0 || bulk && use_array || order_name && !(bulk && ctx.print_mode) || or
+         || (ctx.npreds || seek || index_path || ctx.widths) && ctx.print_mode
+         || shards.header && (list->next == 0 || ctx.print_mode || cache_path || cut_given) ) {
         builtin_usage();
         return EX_USAGE;
     }
 
+    if ( groups.nkeys || groups.naggs ) {
+        for (n = 0; list; list = list->next)
+            ++n;
+        if ( n != groups.naggs || use_array || bulk || ctx.print_mode || cut_given ) {
+            builtin_usage();
+            return EX_USAGE;
+        }
+        // only parse the key fields and the fields aggregated
+        cols = xmalloc((groups.nkeys + groups.naggs) * sizeof(int));
+        for (i = n = 0; i < groups.nkeys; ++i)
+            cols[n++] = groups.keys[i];
+        for (i = 0; i < groups.naggs; ++i)
+            if ( groups.aggs[i].op != AGG_COUNT )
+                cols[n++] = groups.aggs[i].col;
+        select_fields(cols, n, &ctx);
+        xfree(cols);
+        init_reader(&ctx);
+        if ( seek && !seek_row(row, index_path, &ctx) ) {
+            sync_reader(&ctx);
+            return EXECUTION_FAILURE;
+        }
+        return read_into_groups(names, &groups, count, &ctx);
+    }
+
+    if ( scan ) {
+        if ( list->next || use_array || bulk || ctx.print_mode || cut_given || ctx.npreds || ctx.widths ) {
+            builtin_usage();
+            return EX_USAGE;
+        }
+        init_reader(&ctx);
+        if ( seek && !seek_row(row, index_path, &ctx) ) {
+            sync_reader(&ctx);
+            return EXECUTION_FAILURE;
+        }
+        return read_stats(list->word->word, count, &ctx);
+    }
+
+    if ( ctx.print_mode )
+        init_writer(&ctx, fd_given ? ctx.fd : 1);
+    else
+        init_reader(&ctx);
+
+    if ( seek && !seek_row(row, index_path, &ctx) ) {
+        sync_reader(&ctx);
+        return EXECUTION_FAILURE;
+    }
+
+    if ( bulk && ctx.print_mode ) {
+        if ( order_name ) {
+            order = find_variable(order_name);
+            if ( order == 0 || !array_p(order) ) {
+                builtin_error("%s: not an indexed array", order_name);
+                return EXECUTION_FAILURE;
+            }
+        }
+        for (n = 0; list; list = list->next)
+            ++n;
+        columns = xmalloc(n * sizeof(ARRAY *));
+        for (i = 0, list = names; list; list = list->next, ++i) {
+            array = find_variable(list->word->word);
+            if ( array == 0 || !array_p(array) ) {
+                builtin_error("%s: not an indexed array", list->word->word);
+                xfree(columns);
+                return EXECUTION_FAILURE;
+            }
+            columns[i] = array_cell(array);
+        }
+        ret = print_columns(columns, n, order ? array_cell(order) : NULL, &ctx);
+        xfree(columns);
+        if ( finish_writer(&ctx) != EXECUTION_SUCCESS )
+            return EXECUTION_FAILURE;
+        return ret;
+    }
+
+    if ( bulk ) {
+        if ( shards.header ) {
+            if ( (n = header_columns(names, &ordered, &ctx)) < 0 ) {
+                sync_reader(&ctx);
+                return EXECUTION_FAILURE;
+            }
+            names = ordered;
+        }
+        else
+            for (n = 0; list; list = list->next)
+                ++n;
+        if ( callback ) {
+            intval = read_batches(names, n, callback, quantum, count, &ctx);
+            xfree(ordered);
+            return intval > 0 ? EXECUTION_SUCCESS : EXECUTION_FAILURE;
+        }
+        columns = xmalloc(n * sizeof(ARRAY *));
+        if ( !bulk_columns(names, columns) ) {
+            xfree(columns);
+            xfree(ordered);
+            return EXECUTION_FAILURE;
+        }
+        if ( cache_path ) {
+            table = get_cache(cache_path, &ctx);
+            intval = table ? table_columns(table, columns, n, &ctx) : 0;
+            if ( table )
+                free_table(table);
+        }
+        else
+            intval = read_into_columns(columns, n, count, jobs, &ctx);
+        sync_reader(&ctx);
+        xfree(columns);
+        xfree(ordered);
+        return intval > 0 ? EXECUTION_SUCCESS : EXECUTION_FAILURE;
+    }
+
     if ( use_array ) {
         array = header = NULL;
         if ( legal_identifier(list->word->word) == 0 ) {
@@ -406,8 +4842,7 @@ csv_builtin(WORD_LIST *list)
             array = find_or_make_array_variable(list->word->word, 1|2);
             if ( array == 0 )
                 return EXECUTION_FAILURE;
-            if ( !ctx.print_mode )
-                assoc_flush(assoc_cell(array));
+            // emptied by read_into_array, when it cannot reuse the elements
         }
         else {
             array = find_or_make_array_variable(list->word->word, 1);
@@ -435,65 +4870,55 @@ csv_builtin(WORD_LIST *list)
                 print_assoc(assoc_cell(array), header ? array_cell(header) : NULL, &ctx);
             else if ( array_p(array) )
                 print_array(array_cell(array), &ctx);
-            return EXECUTION_SUCCESS;
+            return finish_writer(&ctx);
         }
         else {
             ret = read_into_array(array, header, &ctx);
-            zsyncfd(ctx.fd);
+            sync_reader(&ctx);
         }
         return ret;
     }
 
     if ( ctx.print_mode ) {
-        print_array(array_from_word_list(list), &ctx);
-        return EXECUTION_SUCCESS;
+        print_words(list, &ctx);
+        return finish_writer(&ctx);
     }
 
 
     // Let's go through the list before-hand and check if any of the variables are invalid
-    while ( list ) {
+    while ( list && !handle ) {
         if ( legal_identifier (list->word->word) == 0 && valid_array_reference (list->word->word, 0) == 0 ) {
             sh_invalidid(list->word->word);
             return EXECUTION_FAILURE;
         }
         list = list->next;
     }
-    list = loptend;
+    list = names;
 
-    eor = eos = 0;
-    while (list) {
+    ret = start_row(&ctx) ? EXECUTION_SUCCESS : EXECUTION_FAILURE;
+    eor = ret == EXECUTION_FAILURE;
+    for ( ; list; list = list->next) {
         word = list->word->word;
-        if ( eor )
-            bind_read_variable(word, "");
-        else {
-            while ( !eos && (sep = read_csv_field(&buf, &ctx)) >= 0 && skip_field(ctx.col, &ctx) ) {
-                if ( sep == ctx.rs || ctx.rs == -1 && sep == '\n' ) {
-                    eor = 1;
-                    break;
-                }
-                xfree(buf);
+        buf = "";
+        while ( !eor ) {
+            if ( ctx.col >= ctx.last ) {
+                skip_csv_row(&ctx);
+                eor = 1;
+                break;
             }
-            if (sep == -1) {
-                if (eos)
-                    return EXECUTION_FAILURE;
-                eos = 1;
+            sep = next_field(&field, &ctx);
+            eor = sep == -1 || is_rs(sep, &ctx);
+            if ( !skip_field(ctx.col, &ctx) ) {
+                buf = field_value(&ctx, field);
+                break;
             }
-
-            if ( skip_field(ctx.col, &ctx) )
-                bind_read_variable(word, "");
-            else
-                bind_read_variable(word, buf);
-            xfree(buf);
         }
-
-        list = list->next;
+        bind_read_variable(word, buf);
     }
-    if (sep == -1 && buf[0] == 0)
-        return EXECUTION_FAILURE;
-    if ( !(sep == ctx.rs || ctx.rs == -1 && sep == '\n') )
+    if ( !eor )
         skip_csv_row(&ctx);
-    zsyncfd(ctx.fd);
-    return EXECUTION_SUCCESS;
+    sync_reader(&ctx);
+    return ret;
 }
 
 char *csv_doc[] = {
@@ -513,19 +4938,160 @@ char *csv_doc[] = {
     "           will be used as keys if the first NAME is an associative",
     "           array. If the second NAME is empty, a row will be read into",
     "           it first",
+    "  -A aggs  group-by mode. Read every remaining row, or at most COUNT",
+    "           rows, and aggregate them by the fields listed with -g.",
+    "           AGGS is a comma separated list of count, sum:N, min:N,",
+    "           max:N and mean:N, where N is a field number. The result",
+    "           of the nth aggregate for each group is assigned to the",
+    "           associative array named by the nth NAME, with the values",
+    "           of the -g fields as key. Several fields are separated by",
+    "           SEP, and quoted where needed as when printed. Fields that",
+    "           are not numbers, such as ones with leading blanks, are left",
+    "           out of sum, min, max and mean. Integers are summed exactly",
+    "           unless the sum overflows, and integer minimums and maximums",
+    "           are always given exactly.",
+    "  -b       bulk mode. Read every remaining row, or at most COUNT rows if",
+    "           the -n option is supplied, and append the first field of each",
+    "           row to the indexed array named by the first NAME, the second",
+    "           field to the second NAME, and so on. The arrays are emptied",
+    "           first. With -p, print a row for every index set in any of",
+    "           the arrays named by the NAMEs instead, taking the fields",
+    "           from the elements at that index.",
+    "  -c quantum with -C, read QUANTUM rows at a time. The default is 5000.",
+    "  -C callback with -b, read the rows in batches of QUANTUM rows, like",
+    "           mapfile -C. Before each batch the arrays are emptied, and",
+    "           after it CALLBACK is evaluated with the number of the first",
+    "           row of the batch, counting from 0, and the number of rows in",
+    "           the batch as arguments. With -n, read at most COUNT rows in",
+    "           all. The arrays are left empty.",
     "  -d delim read until the first character of DELIM is read,",
     "           rather than newline or carriage return and newline.",
     "  -f list  read only the listed fields. LIST is a comma separated list",
     "           of numbers and ranges. e.g. -f-2,5,7-8 will pick fields",
     "           0, 1, 2, 5, 7, and 8.",
     "  -F sep   split fields on SEP instead of comma",
+    "  -g list  with -A, group rows by the fields in LIST, a comma",
+    "           separated list of field numbers. Without -g, all rows",
+    "           are in one group with an empty key.",
+    "  -h       with -O, copy the first row to every FD, as a header.",
+    "           With -b, the first NAME is an indexed array holding the",
+    "           header; if it is empty, the next row is read into it first.",
+    "           Every other NAME is then given the column whose header field",
+    "           is that name. Not with -f, -p or -X.",
+    "  -H name  read a row with the reader NAME made with -P. No other",
+    "           options or NAMEs may be given.",
+    "  -i order with -p and -b, print the rows whose indices are the values",
+    "           of the indexed array ORDER, in that order, such as the",
+    "           array made by asort -i.",
+    "  -j jobs  with -b, parse large files with up to JOBS threads, or one",
+    "           per CPU if JOBS is 0. Only used for regular files when all",
+    "           the remaining rows are read. Implies -m.",
+    "  -J name  join mode. Read every remaining row, or at most COUNT",
+    "           rows, and print it to the standard output once for every",
+    "           row of the table NAME made with -L with the same values in",
+    "           the key fields, followed by the fields of the table row",
+    "           that are not key fields. No NAMEs are given.",
+    "  -k list  with -J, the key fields of the rows read, a comma separated",
+    "           list of field numbers, 0 if not supplied. With -O, send",
+    "           every row to the FD picked by a hash of the one field in",
+    "           LIST, so rows with the same value in it go to the same FD,",
+    "           instead of to each FD in turn.",
+    "  -K list  with -J, the key fields of the table, in the same order as",
+    "           those given with -k. The same as -k if not supplied.",
+    "  -l       with -J, also print the rows read that match no table row,",
+    "           with the table's fields empty.",
+    "  -L name  load mode. Read every remaining row, or at most COUNT",
+    "           rows, into the table NAME, kept in memory by csv and",
+    "           replacing any table of that name. No NAMEs are given.",
+    "  -m       parse regular files of 256 KiB or more straight from a",
+    "           mapping of the file, instead of reading them. Faster, but",
+    "           bash is killed with SIGBUS if the file is truncated while",
+    "           csv is reading it.",
+    "  -n count with -b, -A, -J, -L, -O or -S, read at most COUNT rows. 0 means",
+    "           all rows.",
+    "  -o       with -w, start another alternative. A row matches if all",
+    "           the predicates before the first -o hold, or all those",
+    "           between the first and second -o, and so on.",
+    "  -O list  shard mode. Write each remaining row, as it is in the",
+    "           input, to the next of the file descriptors in LIST, a comma",
+    "           separated list, starting over after the last one. Rows",
+    "           with quoted newlines are kept whole. No NAMEs are given.",
     "  -p       print a csv row instead of reading one. Each NAME are printed",
     "           separated by SEP, and quoted if necessary. If the -a option",
     "           is supplied, the first NAME is treated as an array holding the",
     "           values for the row. A second NAME may be provided to specify",
-    "           the order of the printed fields.",
+    "           the order of the printed fields. Output is written to the",
+    "           standard output, or to FD if the -u option is supplied.",
+    "  -P name  make a reader called NAME instead of reading, which reads",
+    "           rows with the other options given and into the NAMEs",
+    "           given when used with -H. Without NAMEs, the reader is",
+    "           removed. Only reading rows into variables and with -a is",
+    "           supported.",
     "  -q quote use QUOTE as quote character, rather than `\"'.",
-    "  -u fd    read from file descriptor FD instead of the standard input.",
+    "  -R       discard what has been read ahead from FD and return. On a",
+    "           seekable FD the file offset is moved back to the end of the",
+    "           last row read first.",
+    "  -s row   start reading at row number ROW of the file, counting from",
+    "           0, instead of at the current offset. FD must be seekable.",
+    "           With -b and -n, read the range of COUNT rows from ROW.",
+    "  -S       scan mode. Parse every remaining row, or at most COUNT rows,",
+    "           without assigning any fields, and set the elements rows,",
+    "           bytes, min_fields, max_fields, longest_field, malformed,",
+    "           syscalls and seconds of the associative array NAME to",
+    "           what was found and how long it took. A row is malformed if",
+    "           a quote is not at the start of a field, text follows a",
+    "           closing quote or a quote is still open at eof. The first",
+    "           100 of them are listed, by row number from where the scan",
+    "           started, in malformed_rows, and by offset in the file in",
+    "           malformed_offsets.",
+    "  -t       TSV mode. Split fields on tab, or SEP if the -F option is",
+    "           supplied, and read quote characters like any other byte.",
+    "  -T name  run a command on the table NAME made with -L. The NAMEs",
+    "           are the command and its arguments, one of:",
+    "             rows VAR, cols VAR: set VAR to the number of rows, or",
+    "               of fields in the longest row",
+    "             cell ROW COL VAR: set VAR to the field COL of row ROW",
+    "             row ROW VAR...: set the VARs to the fields of row ROW,",
+    "               or with -a, the indexed array VAR",
+    "             column COL VAR [FROM [COUNT]]: set the indexed array",
+    "               VAR to field COL of COUNT rows from row FROM on",
+    "           Rows and fields count from 0, and the command fails if",
+    "           there is no such row. Without NAMEs, the table is removed.",
+    "  -u fd    read from file descriptor FD instead of the standard input,",
+    "           or write to it with -p.",
+    "  -w pred  only read rows for which PRED holds, skipping the others.",
+    "           PRED is a field number followed by = != or ^= and a",
+    "           string, to test for equality, inequality or a prefix, or",
+    "           by == < <= > or >= and a number, to compare the field as a",
+    "           number. Fields that are not numbers fail numeric tests.",
+    "           Predicates given with more than one -w must all hold.",
+    "  -W list  fixed width mode. LIST is a comma separated list of the",
+    "           widths of the fields in bytes. Each row is cut into fields",
+    "           of those widths, padding included, and the rest of the row",
+    "           after the last one is skipped. Not used with -p.",
+    "  -x index with -s, find the row with the row index in the file INDEX",
+    "           instead of by skipping rows from the start. The index is",
+    "           made, or made again if the file changed since, and saved",
+    "           to INDEX first when needed. Without -s and NAMEs, just",
+    "           make sure INDEX is up to date.",
+    "  -X cache with -L or -b, get all the rows of the file from the",
+    "           cache in the file CACHE, without parsing them. The cache",
+    "           is made, or made again if the file or the separators",
+    "           changed since, and saved to CACHE first when needed. FD",
+    "           is left at the end of the file. -n, -s and -w are not",
+    "           used with it, nor -f with -L.",
+    "  -z comp  read input compressed with COMP, which is gzip or zstd,",
+    "           or none for input that is not compressed. By default,",
+    "           gzip and zstd input is told by its first bytes. Only",
+    "           used on the first call for an FD, the first after -R, or",
+    "           the first after a compressed file on FD was reopened or",
+    "           moved with lseek.",
+    "",
+    "Input is read ahead in large blocks. Bytes read ahead from a pipe are",
+    "kept for the next csv call on the same FD, so other commands reading",
+    "from that pipe will not see them until the rows are read with csv or",
+    "discarded with -R. Compressed input is read the same way as a pipe,",
+    "even from a regular file, and cannot be used with -s or -x.",
     "",
     "Exit Status:",
     "The return code is zero, unless an error occured, or end-of-file was",
@@ -538,7 +5104,7 @@ struct builtin csv_struct = {
     csv_builtin,
     BUILTIN_ENABLED,
     csv_doc,
-    "csv [-ap] [-d delim] [-f list] [-F sep] [-q quote] [-u fd] name ...",
+    "csv [-abhlmopRSt] [-A aggs] [-c quantum] [-C callback] [-d delim] [-f list] [-F sep] [-g list] [-H name] [-i order] [-j jobs] [-J name] [-k list] [-K list] [-L name] [-n count] [-O list] [-P name] [-q quote] [-s row] [-T name] [-u fd] [-w pred] [-W list] [-x index] [-X cache] [-z comp] name ...",
     0
 };
 